@@ -3,23 +3,87 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <memory>
 #include <variant>
+#include <vector>
+#include <cassert>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <atomic>
+#include <thread>
+#include <limits>
+#include <unordered_map>
+#include <span>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
 
-inline bool IsOperation(char op) {
+constexpr bool IsOperation(char op) {
     return op == '*' || op == '/' || op == '+' || op == '-';
 }
 
-inline bool IsScope(char c) {
+constexpr bool IsScope(char c) {
     return c == '(' || c == ')';
 }
 
+constexpr bool IsNameStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool IsNameChar(char c) {
+    return IsNameStart(c) || (c >= '0' && c <= '9');
+}
+
+constexpr int64_t ApplyOperation(char op_type, int64_t left, int64_t right) {
+    switch (op_type) {
+        case '*':
+            return left * right;
+        case '/':
+            return left / right;
+        case '+':
+            return left + right;
+        case '-':
+            return left - right;
+        default:
+            assert(!"Unsupported operation");
+            return 0;
+    }
+}
+
+// ApplyOperation that returns false instead of overflowing. Division by zero is left to the
+// caller.
+inline bool ApplyNarrow(char op_type, int64_t left, int64_t right, int64_t* result) {
+    switch (op_type) {
+        case '*':
+            return !__builtin_mul_overflow(left, right, result);
+        case '/':
+            if (left == std::numeric_limits<int64_t>::min() && right == -1) {
+                return false;
+            }
+            *result = left / right;
+            return true;
+        case '+':
+            return !__builtin_add_overflow(left, right, result);
+        case '-':
+            return !__builtin_sub_overflow(left, right, result);
+        default:
+            assert(!"Unsupported operation");
+            return false;
+    }
+}
+
 class Tokenizer {
 public:
     Tokenizer(std::istream* in) : in_(in) {
     }
 
-    enum TokenType { kUnknown, kNumber, kSymbol, kEnd };
+    enum TokenType { kUnknown, kNumber, kSymbol, kEnd, kName };
 
     bool NextSub() {
         TokenType next_token_type = WatchNext();
@@ -38,6 +102,8 @@ public:
             return TokenType::kNumber;
         } else if (IsOperation(c) || IsScope(c)) {
             return TokenType::kSymbol;
+        } else if (names_ && IsNameStart(c)) {
+            return TokenType::kName;
         } else if (c == EOF) {
             return TokenType::kEnd;
         } else {
@@ -66,6 +132,15 @@ public:
                 number_ = number_ * 10 + (digit - '0');
                 c = in_->peek();
             }
+        } else if (next_token_type == TokenType::kName) {
+            char c = in_->peek();
+            type_ = TokenType::kName;
+            name_.clear();
+            while (c != EOF && IsNameChar(c)) {
+                name_.push_back(c);
+                in_->get(c);
+                c = in_->peek();
+            }
         } else {
             type_ = TokenType::kEnd;
         }
@@ -83,25 +158,230 @@ public:
         return symbol_;
     }
 
+    std::string_view GetName() {
+        return name_;
+    }
+
+    // Names are off by default: letters are then skipped like any other unknown character.
+    void SetNames(bool names) {
+        names_ = names;
+    }
+
 private:
     std::istream* in_;
 
     TokenType type_ = TokenType::kUnknown;
     int64_t number_;
     char symbol_;
+    std::string name_;
+    bool names_ = false;
+};
+
+// Tokenizer over a contiguous buffer (a string, a memory-mapped file, ...). Scans with plain
+// pointer arithmetic instead of going through std::istream for every character. The buffer
+// must outlive the tokenizer.
+class BufferTokenizer {
+public:
+    using TokenType = Tokenizer::TokenType;
+
+    constexpr BufferTokenizer(std::string_view buffer)
+        : cur_(buffer.data()), end_(buffer.data() + buffer.size()) {
+    }
+
+    constexpr bool NextSub() {
+        SkipUnknown();
+        return cur_ != end_ && *cur_ == '-';
+    }
+
+    constexpr TokenType WatchNext() {
+        if (cur_ == end_) {
+            return TokenType::kEnd;
+        }
+        char c = *cur_;
+        if (IsDigit(c)) {
+            return TokenType::kNumber;
+        } else if (IsOperation(c) || IsScope(c)) {
+            return TokenType::kSymbol;
+        } else if (names_ && IsNameStart(c)) {
+            return TokenType::kName;
+        } else {
+            return TokenType::kUnknown;
+        }
+    }
+
+    constexpr void Consume() {
+        SkipUnknown();
+        if (cur_ == end_) {
+            type_ = TokenType::kEnd;
+        } else if (IsDigit(*cur_)) {
+            type_ = TokenType::kNumber;
+            const char* digits_end = cur_;
+            while (digits_end != end_ && IsDigit(*digits_end)) {
+                ++digits_end;
+            }
+            bool parsed = false;
+            if (!std::is_constant_evaluated()) {
+                auto [ptr, ec] = std::from_chars(cur_, digits_end, number_);
+                parsed = ec == std::errc();
+            }
+            if (!parsed) {
+                // Out of range (or from_chars is unavailable at compile time): wrap around like
+                // Tokenizer does.
+                uint64_t number = 0;
+                for (const char* it = cur_; it != digits_end; ++it) {
+                    number = number * 10 + (*it - '0');
+                }
+                number_ = static_cast<int64_t>(number);
+            }
+            cur_ = digits_end;
+        } else if (names_ && IsNameStart(*cur_)) {
+            type_ = TokenType::kName;
+            const char* name_end = cur_;
+            while (name_end != end_ && IsNameChar(*name_end)) {
+                ++name_end;
+            }
+            name_ = std::string_view(cur_, name_end - cur_);
+            cur_ = name_end;
+        } else {
+            type_ = TokenType::kSymbol;
+            symbol_ = *cur_++;
+        }
+    }
+
+    constexpr TokenType GetType() {
+        return type_;
+    }
+
+    constexpr int64_t GetNumber() {
+        return number_;
+    }
+
+    constexpr char GetSymbol() {
+        return symbol_;
+    }
+
+    // Points into the buffer.
+    constexpr std::string_view GetName() {
+        return name_;
+    }
+
+    // Names are off by default: letters are then skipped like any other unknown character.
+    constexpr void SetNames(bool names) {
+        names_ = names;
+    }
+
+private:
+    static constexpr bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    constexpr void SkipUnknown() {
+        while (cur_ != end_ && WatchNext() == TokenType::kUnknown) {
+            ++cur_;
+        }
+    }
+
+    const char* cur_;
+    const char* end_;
+
+    TokenType type_ = TokenType::kUnknown;
+    int64_t number_ = 0;
+    char symbol_ = 0;
+    std::string_view name_;
+    bool names_ = false;
+};
+
+// Assigns every distinct variable name an index into the bindings passed to Evaluate, in order
+// of first appearance.
+class VariableTable {
+public:
+    size_t Resolve(std::string_view name) {
+        auto [it, inserted] = indices_.emplace(std::string(name), names_.size());
+        if (inserted) {
+            names_.push_back(it->first);
+        }
+        return it->second;
+    }
+
+    const std::vector<std::string>& GetNames() const {
+        return names_;
+    }
+
+private:
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, size_t> indices_;
+};
+
+// Values of the variables, indexed as assigned by the VariableTable used for parsing.
+using Bindings = std::span<const int64_t>;
+
+// Receives intermediate results of Expression::Evaluate in post-order.
+class TraceSink {
+public:
+    virtual ~TraceSink() {
+    }
+    virtual void Record(char op_type, int64_t value) = 0;
+};
+
+// Buffers the trace so it can be printed after evaluation instead of on the hot path.
+class TraceCollector : public TraceSink {
+public:
+    struct Entry {
+        char op_type;
+        int64_t value;
+    };
+
+    void Record(char op_type, int64_t value) override {
+        entries_.push_back({op_type, value});
+    }
+
+    const std::vector<Entry>& GetEntries() const {
+        return entries_;
+    }
+
+    void Print(std::ostream* out) const {
+        for (const auto& entry : entries_) {
+            *out << entry.value << "\n";
+        }
+    }
+
+    void Clear() {
+        entries_.clear();
+    }
+
+private:
+    std::vector<Entry> entries_;
 };
 
+enum class ExpressionKind { kConst, kVariable, kOperation };
+
 class Expression {
 public:
     virtual ~Expression() {
     }
-    virtual int64_t Evaluate() = 0;
+    virtual ExpressionKind GetKind() const = 0;
+    // Visits every node exactly once. Results of operations are reported to sink if it is set.
+    virtual int64_t Evaluate(Bindings bindings, TraceSink* sink = nullptr) = 0;
+
+    int64_t Evaluate(TraceSink* sink = nullptr) {
+        return Evaluate(Bindings(), sink);
+    }
 };
 
 class Const : public Expression {
 public:
+    using Expression::Evaluate;
+
     Const(int64_t value) : val_(value){};
-    int64_t Evaluate() {
+    ExpressionKind GetKind() const override {
+        return ExpressionKind::kConst;
+    }
+
+    int64_t Evaluate(Bindings, TraceSink* = nullptr) override {
+        return val_;
+    }
+
+    int64_t GetValue() const {
         return val_;
     }
 
@@ -109,64 +389,227 @@ private:
     int64_t val_;
 };
 
+class Variable : public Expression {
+public:
+    using Expression::Evaluate;
+
+    Variable(size_t index) : index_(index){};
+    ExpressionKind GetKind() const override {
+        return ExpressionKind::kVariable;
+    }
+
+    int64_t Evaluate(Bindings bindings, TraceSink* = nullptr) override {
+        assert(index_ < bindings.size() && "Unbound variable");
+        return bindings[index_];
+    }
+
+    size_t GetIndex() const {
+        return index_;
+    }
+
+private:
+    size_t index_;
+};
+
 class Operation : public Expression {
 public:
-    Operation(char op_type, Expression* left, Expression* right)
-        : op_type_(op_type), left_(left), right_(right){};
+    using Expression::Evaluate;
 
-    int64_t Evaluate() override {
-        switch (op_type_) {
-            case '*':
-                std::cout << (left_->Evaluate() * right_->Evaluate()) << "\n";
-                return left_->Evaluate() * right_->Evaluate();
-            case '/':
-                std::cout << (left_->Evaluate() / right_->Evaluate()) << "\n";
-                return left_->Evaluate() / right_->Evaluate();
-            case '+':
-                std::cout << (left_->Evaluate() + right_->Evaluate()) << "\n";
-                return left_->Evaluate() + right_->Evaluate();
-            case '-':
-                std::cout << (left_->Evaluate() - right_->Evaluate()) << "\n";
-                return left_->Evaluate() - right_->Evaluate();
-            default:
-                assert("Unsupported operation");
-                return 0;
+    // Children allocated in an ExpressionArena are not owned and are never deleted.
+    Operation(char op_type, Expression* left, Expression* right, bool owns_children = true)
+        : op_type_(op_type), owns_children_(owns_children), left_(left), right_(right){};
+
+    Operation(const Operation&) = delete;
+    Operation& operator=(const Operation&) = delete;
+
+    // Deletes the owned subtree with an explicit stack, so that destroying a deep tree cannot
+    // overflow the call stack.
+    ~Operation() {
+        if (!owns_children_ || (!left_ && !right_)) {
+            return;
+        }
+        std::vector<Expression*> pending = {left_, right_};
+        while (!pending.empty()) {
+            Expression* expr = pending.back();
+            pending.pop_back();
+            if (expr && expr->GetKind() == ExpressionKind::kOperation) {
+                auto op = static_cast<Operation*>(expr);
+                if (op->owns_children_) {
+                    pending.push_back(op->left_);
+                    pending.push_back(op->right_);
+                    op->left_ = nullptr;
+                    op->right_ = nullptr;
+                }
+            }
+            delete expr;
+        }
+    }
+
+    ExpressionKind GetKind() const override {
+        return ExpressionKind::kOperation;
+    }
+
+    int64_t Evaluate(Bindings bindings, TraceSink* sink = nullptr) override {
+        int64_t left = left_->Evaluate(bindings, sink);
+        int64_t right = right_->Evaluate(bindings, sink);
+        int64_t result = ApplyOperation(op_type_, left, right);
+        if (sink) {
+            sink->Record(op_type_, result);
         }
+        return result;
+    }
+
+    char GetOpType() const {
+        return op_type_;
+    }
+
+    const Expression* GetLeft() const {
+        return left_;
+    }
+
+    const Expression* GetRight() const {
+        return right_;
     }
 
 private:
     char op_type_;
-    std::unique_ptr<Expression> left_;
-    std::unique_ptr<Expression> right_;
+    bool owns_children_;
+    Expression* left_;
+    Expression* right_;
+};
+
+// Monotonic allocator for parse trees. Nodes are bump-allocated in parse order, so children
+// sit next to their parent, and the whole tree is released at once by Reset or the
+// destructor without walking it. Node destructors are never run.
+class ExpressionArena {
+public:
+    static constexpr size_t kDefaultBlockSize = 4096;
+
+    explicit ExpressionArena(size_t block_size = kDefaultBlockSize) : block_size_(block_size) {
+    }
+
+    ExpressionArena(const ExpressionArena&) = delete;
+    ExpressionArena& operator=(const ExpressionArena&) = delete;
+
+    template <class T, class... Args>
+    T* Create(Args&&... args) {
+        static_assert(std::is_base_of_v<Expression, T>);
+        void* place = Allocate(sizeof(T), alignof(T));
+        return new (place) T(std::forward<Args>(args)...);
+    }
+
+    // Invalidates every node. If the last expression spilled over several blocks they are merged
+    // into one, so steady-state parsing does a single allocation up front and none afterwards.
+    void Reset() {
+        if (blocks_.size() > 1) {
+            size_t total = 0;
+            for (const auto& block : blocks_) {
+                total += block.size;
+            }
+            blocks_.clear();
+            AddBlock(total);
+        }
+        used_ = 0;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    void AddBlock(size_t size) {
+        blocks_.push_back({std::make_unique<std::byte[]>(size), size});
+        used_ = 0;
+    }
+
+    void* Allocate(size_t size, size_t alignment) {
+        size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+        if (blocks_.empty() || offset + size > blocks_.back().size) {
+            AddBlock(std::max(block_size_, size + alignment));
+            offset = 0;
+        }
+        used_ = offset + size;
+        return blocks_.back().data.get() + offset;
+    }
+
+    size_t block_size_;
+    size_t used_ = 0;
+    std::vector<Block> blocks_;
 };
 
-Expression* ParserE(Tokenizer* tok);
-Expression* ParserT1(Tokenizer* tok);
-Expression* ParserT2(Tokenizer* tok);
-Expression* ParserT3(Tokenizer* tok);
+inline Expression* MakeConst(ExpressionArena* arena, int64_t value) {
+    if (arena) {
+        return arena->Create<Const>(value);
+    }
+    return new Const(value);
+}
+
+inline Expression* MakeVariable(ExpressionArena* arena, size_t index) {
+    if (arena) {
+        return arena->Create<Variable>(index);
+    }
+    return new Variable(index);
+}
+
+inline Expression* MakeOperation(ExpressionArena* arena, char op_type, Expression* left,
+                                 Expression* right) {
+    if (arena) {
+        return arena->Create<Operation>(op_type, left, right, false);
+    }
+    return new Operation(op_type, left, right);
+}
+
+// The parser works with any tokenizer exposing the Tokenizer interface
+// (Tokenizer, BufferTokenizer).
+template <class Tok>
+Expression* ParserE(Tok* tok, ExpressionArena* arena = nullptr,
+                     VariableTable* variables = nullptr);
+template <class Tok>
+Expression* ParserT1(Tok* tok, ExpressionArena* arena = nullptr,
+                     VariableTable* variables = nullptr);
+template <class Tok>
+Expression* ParserT2(Tok* tok, ExpressionArena* arena = nullptr,
+                     VariableTable* variables = nullptr);
+template <class Tok>
+Expression* ParserT3(Tok* tok, ExpressionArena* arena = nullptr,
+                     VariableTable* variables = nullptr);
 
-std::unique_ptr<Expression> ParseExpression(Tokenizer* tok) {
-    return std::unique_ptr<Expression>(ParserE(tok));
+// Names are resolved through variables. Without a table letters are skipped, so "1 + a2" is
+// 1 + 2.
+template <class Tok>
+std::unique_ptr<Expression> ParseExpression(Tok* tok, VariableTable* variables = nullptr) {
+    return std::unique_ptr<Expression>(ParserE(tok, nullptr, variables));
 }
 
-Expression* ParserE(Tokenizer* tok) {
-    Expression* left = ParserT1(tok);
+// The result is owned by arena and stays valid until its next Reset.
+template <class Tok>
+Expression* ParseExpression(Tok* tok, ExpressionArena* arena, VariableTable* variables = nullptr) {
+    return ParserE(tok, arena, variables);
+}
+
+template <class Tok>
+Expression* ParserE(Tok* tok, ExpressionArena* arena, VariableTable* variables) {
+    // ParserT3 can only resolve names with a table.
+    tok->SetNames(variables != nullptr);
+    Expression* left = ParserT1(tok, arena, variables);
     if (tok->GetType() == Tokenizer::TokenType::kEnd) {
         return left;
     } else {
         while (tok->GetType() == Tokenizer::TokenType::kSymbol &&
                (tok->GetSymbol() == '-' || tok->GetSymbol() == '+')) {
             auto op = tok->GetSymbol();
-            Expression* right = ParserT1(tok);
-            Expression* vertex = new Operation(op, left, right);
+            Expression* right = ParserT1(tok, arena, variables);
+            Expression* vertex = MakeOperation(arena, op, left, right);
             left = vertex;
         }
         return left;
     }
 }
 
-Expression* ParserT1(Tokenizer* tok) {
-    Expression* left = ParserT2(tok);
+template <class Tok>
+Expression* ParserT1(Tok* tok, ExpressionArena* arena, VariableTable* variables) {
+    Expression* left = ParserT2(tok, arena, variables);
     tok->Consume();
     if (tok->GetType() == Tokenizer::TokenType::kEnd) {
         return left;
@@ -174,8 +617,8 @@ Expression* ParserT1(Tokenizer* tok) {
         while (tok->GetType() == Tokenizer::TokenType::kSymbol &&
                (tok->GetSymbol() == '*' || tok->GetSymbol() == '/')) {
             auto op = tok->GetSymbol();
-            Expression* right = ParserT2(tok);
-            Expression* vertex = new Operation(op, left, right);
+            Expression* right = ParserT2(tok, arena, variables);
+            Expression* vertex = MakeOperation(arena, op, left, right);
             left = vertex;
             tok->Consume();
         }
@@ -183,26 +626,1357 @@ Expression* ParserT1(Tokenizer* tok) {
     }
 }
 
-Expression* ParserT2(Tokenizer* tok) {
+template <class Tok>
+Expression* ParserT2(Tok* tok, ExpressionArena* arena, VariableTable* variables) {
     if (tok->NextSub()) {
-        Expression* left = new Const(0);
+        Expression* left = MakeConst(arena, 0);
         tok->Consume();
-        Expression* right = ParserT3(tok);
-        Expression* vertex = new Operation('-', left, right);
+        Expression* right = ParserT3(tok, arena, variables);
+        Expression* vertex = MakeOperation(arena, '-', left, right);
         return vertex;
     } else {
-        return ParserT3(tok);
+        return ParserT3(tok, arena, variables);
     }
 }
 
-Expression* ParserT3(Tokenizer* tok) {
+template <class Tok>
+Expression* ParserT3(Tok* tok, ExpressionArena* arena, VariableTable* variables) {
     tok->Consume();
     Expression* ans = nullptr;
     if (tok->GetType() == Tokenizer::TokenType::kNumber) {
-        return new Const(tok->GetNumber());
+        return MakeConst(arena, tok->GetNumber());
+    } else if (tok->GetType() == Tokenizer::TokenType::kName && variables) {
+        return MakeVariable(arena, variables->Resolve(tok->GetName()));
     } else if (tok->GetType() == Tokenizer::TokenType::kSymbol &&
                (tok->GetSymbol() == '(' || tok->GetSymbol() == ')')) {
-        ans = ParserE(tok);
+        ans = ParserE(tok, arena, variables);
     }
     return ans;
 }
+
+// Rewrites a tree into an equivalent DAG allocated in arena: constant subtrees are folded,
+// unary minus (which ParserT2 builds as 0 - x) is pushed outwards and cancelled, neutral
+// elements are dropped and structurally identical subtrees are shared. Division by zero is
+// never folded so it still happens at evaluation time, and x * 0 is only folded if x contains
+// no division that can trap. A shared node is revisited by
+// Expression::Evaluate; compile the result to have each unique subexpression computed once.
+class Optimizer {
+public:
+    explicit Optimizer(ExpressionArena& arena) : arena_(&arena) {
+    }
+
+    Expression* Optimize(const Expression* expr) {
+        auto it = visited_.find(expr);
+        if (it != visited_.end()) {
+            return it->second;
+        }
+        Expression* result;
+        if (expr->GetKind() == ExpressionKind::kConst) {
+            result = MakeConst(static_cast<const Const*>(expr)->GetValue());
+        } else if (expr->GetKind() == ExpressionKind::kVariable) {
+            auto index = static_cast<int64_t>(static_cast<const Variable*>(expr)->GetIndex());
+            result = Intern({ExpressionKind::kVariable, 0, index, nullptr, nullptr});
+        } else {
+            auto op = static_cast<const Operation*>(expr);
+            Expression* left = Optimize(op->GetLeft());
+            Expression* right = Optimize(op->GetRight());
+            result = MakeOperation(op->GetOpType(), left, right);
+        }
+        visited_[expr] = result;
+        return result;
+    }
+
+private:
+    struct Key {
+        ExpressionKind kind;
+        char op_type;
+        int64_t value;
+        const Expression* left;
+        const Expression* right;
+
+        bool operator==(const Key& other) const {
+            return kind == other.kind && op_type == other.op_type && value == other.value &&
+                   left == other.left && right == other.right;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            size_t hash = std::hash<int64_t>()(key.value);
+            auto combine = [&hash](size_t value) {
+                hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+            };
+            combine(static_cast<size_t>(key.kind));
+            combine(static_cast<size_t>(key.op_type));
+            combine(std::hash<const Expression*>()(key.left));
+            combine(std::hash<const Expression*>()(key.right));
+            return hash;
+        }
+    };
+
+    static bool IsConst(const Expression* expr, int64_t value) {
+        return expr->GetKind() == ExpressionKind::kConst &&
+               static_cast<const Const*>(expr)->GetValue() == value;
+    }
+
+    // Returns x if expr is 0 - x, nullptr otherwise.
+    static Expression* GetNegated(Expression* expr) {
+        if (expr->GetKind() != ExpressionKind::kOperation) {
+            return nullptr;
+        }
+        auto op = static_cast<Operation*>(expr);
+        if (op->GetOpType() != '-' || !IsConst(op->GetLeft(), 0)) {
+            return nullptr;
+        }
+        return const_cast<Expression*>(op->GetRight());
+    }
+
+    Expression* MakeConst(int64_t value) {
+        return Intern({ExpressionKind::kConst, 0, value, nullptr, nullptr});
+    }
+
+    Expression* Negate(Expression* expr) {
+        return MakeOperation('-', MakeConst(0), expr);
+    }
+
+    Expression* MakeOperation(char op_type, Expression* left, Expression* right) {
+        if (left->GetKind() == ExpressionKind::kConst &&
+            right->GetKind() == ExpressionKind::kConst) {
+            int64_t left_value = static_cast<const Const*>(left)->GetValue();
+            int64_t right_value = static_cast<const Const*>(right)->GetValue();
+            bool traps = op_type == '/' && (right_value == 0 || (right_value == -1 &&
+                                            left_value == std::numeric_limits<int64_t>::min()));
+            if (!traps) {
+                return MakeConst(ApplyOperation(op_type, left_value, right_value));
+            }
+        }
+
+        Expression* left_negated = GetNegated(left);
+        Expression* right_negated = GetNegated(right);
+        switch (op_type) {
+            case '+':
+                if (IsConst(left, 0)) {
+                    return right;
+                } else if (IsConst(right, 0)) {
+                    return left;
+                } else if (right_negated) {
+                    return MakeOperation('-', left, right_negated);
+                } else if (left_negated) {
+                    return MakeOperation('-', right, left_negated);
+                }
+                break;
+            case '-':
+                if (IsConst(right, 0)) {
+                    return left;
+                } else if (right_negated) {
+                    // Covers -(-x) as well, since 0 + x folds to x.
+                    return MakeOperation('+', left, right_negated);
+                }
+                break;
+            case '*':
+                if ((IsConst(left, 0) && !may_trap_[right]) ||
+                    (IsConst(right, 0) && !may_trap_[left])) {
+                    return MakeConst(0);
+                } else if (IsConst(left, 1)) {
+                    return right;
+                } else if (IsConst(right, 1)) {
+                    return left;
+                } else if (left_negated && right_negated) {
+                    return MakeOperation('*', left_negated, right_negated);
+                } else if (left_negated) {
+                    return Negate(MakeOperation('*', left_negated, right));
+                } else if (right_negated) {
+                    return Negate(MakeOperation('*', left, right_negated));
+                }
+                break;
+            case '/':
+                if (IsConst(right, 1)) {
+                    return left;
+                }
+                break;
+        }
+
+        // Commutative operations get a canonical operand order so a + b and b + a are shared.
+        if ((op_type == '+' || op_type == '*') && ids_[right] < ids_[left]) {
+            std::swap(left, right);
+        }
+        return Intern({ExpressionKind::kOperation, op_type, 0, left, right});
+    }
+
+    Expression* Intern(const Key& key) {
+        auto it = nodes_.find(key);
+        if (it != nodes_.end()) {
+            return it->second;
+        }
+        Expression* node;
+        if (key.kind == ExpressionKind::kConst) {
+            node = ::MakeConst(arena_, key.value);
+        } else if (key.kind == ExpressionKind::kVariable) {
+            node = ::MakeVariable(arena_, key.value);
+        } else {
+            node = ::MakeOperation(arena_, key.op_type, const_cast<Expression*>(key.left),
+                                   const_cast<Expression*>(key.right));
+            bool safe_divisor = key.right->GetKind() == ExpressionKind::kConst &&
+                                !IsConst(key.right, 0) && !IsConst(key.right, -1);
+            may_trap_[node] = may_trap_[key.left] || may_trap_[key.right] ||
+                              (key.op_type == '/' && !safe_divisor);
+        }
+        ids_[node] = nodes_.size();
+        nodes_.emplace(key, node);
+        return node;
+    }
+
+    ExpressionArena* arena_;
+    std::unordered_map<Key, Expression*, KeyHash> nodes_;
+    std::unordered_map<const Expression*, size_t> ids_;
+    // Whether evaluating the node can divide by zero or overflow a division.
+    std::unordered_map<const Expression*, bool> may_trap_;
+    std::unordered_map<const Expression*, Expression*> visited_;
+};
+
+// The result shares nodes, so it can only live in an arena.
+inline Expression* Optimize(const Expression& expr, ExpressionArena& arena) {
+    return Optimizer(arena).Optimize(&expr);
+}
+
+// Postfix bytecode. The tree is lowered once by Compile and executed by Run
+// without virtual calls or pointer chasing.
+// Shared DAG nodes are computed once, kept in a slot with kStore and reused with kLoad.
+enum class OpCode : uint8_t { kPush, kVariable, kLoad, kStore, kAdd, kSub, kMul, kDiv };
+
+struct Instruction {
+    OpCode code;
+    int64_t operand;
+};
+
+struct Program {
+    std::vector<Instruction> code;
+    size_t max_stack = 0;
+    size_t num_slots = 0;
+};
+
+inline OpCode GetOpCode(char op_type) {
+    switch (op_type) {
+        case '*':
+            return OpCode::kMul;
+        case '/':
+            return OpCode::kDiv;
+        case '+':
+            return OpCode::kAdd;
+        case '-':
+            return OpCode::kSub;
+        default:
+            assert(!"Unsupported operation");
+            return OpCode::kAdd;
+    }
+}
+
+struct CompileState {
+    std::unordered_map<const Expression*, size_t> uses;
+    std::unordered_map<const Expression*, int64_t> slots;
+    size_t depth = 0;
+};
+
+inline void CountUses(const Expression* expr, CompileState* state) {
+    if (state->uses[expr]++ == 0 && expr->GetKind() == ExpressionKind::kOperation) {
+        auto op = static_cast<const Operation*>(expr);
+        CountUses(op->GetLeft(), state);
+        CountUses(op->GetRight(), state);
+    }
+}
+
+inline void Push(Program* program, CompileState* state, Instruction instruction) {
+    program->code.push_back(instruction);
+    state->depth += 1;
+    program->max_stack = std::max(program->max_stack, state->depth);
+}
+
+inline void CompileNode(const Expression* expr, Program* program, CompileState* state) {
+    if (expr->GetKind() == ExpressionKind::kConst) {
+        Push(program, state, {OpCode::kPush, static_cast<const Const*>(expr)->GetValue()});
+        return;
+    } else if (expr->GetKind() == ExpressionKind::kVariable) {
+        auto index = static_cast<int64_t>(static_cast<const Variable*>(expr)->GetIndex());
+        Push(program, state, {OpCode::kVariable, index});
+        return;
+    }
+    auto slot = state->slots.find(expr);
+    if (slot != state->slots.end()) {
+        Push(program, state, {OpCode::kLoad, slot->second});
+        return;
+    }
+    auto op = static_cast<const Operation*>(expr);
+    CompileNode(op->GetLeft(), program, state);
+    CompileNode(op->GetRight(), program, state);
+    program->code.push_back({GetOpCode(op->GetOpType()), 0});
+    state->depth -= 1;
+    if (state->uses[expr] > 1) {
+        int64_t index = program->num_slots++;
+        state->slots[expr] = index;
+        program->code.push_back({OpCode::kStore, index});
+    }
+}
+
+inline Program Compile(const Expression& expr) {
+    Program program;
+    CompileState state;
+    CountUses(&expr, &state);
+    CompileNode(&expr, &program, &state);
+    return program;
+}
+
+// Operand stack and slots that fit almost every expression; larger programs fall back to the
+// heap.
+constexpr size_t kVmStackSize = 64;
+
+inline int64_t Run(const Program& program, Bindings bindings = {}) {
+    int64_t fixed_stack[kVmStackSize];
+    std::vector<int64_t> heap_stack;
+    int64_t* stack = fixed_stack;
+    if (program.max_stack + program.num_slots > kVmStackSize) {
+        heap_stack.resize(program.max_stack + program.num_slots);
+        stack = heap_stack.data();
+    }
+
+    int64_t* slots = stack + program.max_stack;
+    int64_t* top = stack;
+    for (const auto& instruction : program.code) {
+        switch (instruction.code) {
+            case OpCode::kPush:
+                *top++ = instruction.operand;
+                break;
+            case OpCode::kVariable:
+                *top++ = bindings[instruction.operand];
+                break;
+            case OpCode::kLoad:
+                *top++ = slots[instruction.operand];
+                break;
+            case OpCode::kStore:
+                slots[instruction.operand] = top[-1];
+                break;
+            case OpCode::kAdd:
+                --top;
+                top[-1] = top[-1] + top[0];
+                break;
+            case OpCode::kSub:
+                --top;
+                top[-1] = top[-1] - top[0];
+                break;
+            case OpCode::kMul:
+                --top;
+                top[-1] = top[-1] * top[0];
+                break;
+            case OpCode::kDiv:
+                --top;
+                top[-1] = top[-1] / top[0];
+                break;
+        }
+    }
+    return top[-1];
+}
+
+// Splits buffer into lines. A newline at the very end does not start another line.
+inline std::vector<std::string_view> SplitExpressions(std::string_view buffer) {
+    std::vector<std::string_view> lines;
+    while (!buffer.empty()) {
+        size_t end = buffer.find('\n');
+        lines.push_back(buffer.substr(0, end));
+        if (end == std::string_view::npos) {
+            break;
+        }
+        buffer.remove_prefix(end + 1);
+    }
+    return lines;
+}
+
+// Columnar counterpart of Run: evaluates program for every row of the columns (one per
+// variable, all of out.size() rows) and writes the results to out. Each instruction is applied
+// to a block of kColumnBlockSize rows at once, so the + - * kernels are simple loops over
+// contiguous arrays that the compiler vectorizes. Variables are read from the columns in place.
+constexpr size_t kColumnBlockSize = 256;
+
+template <class Op>
+inline void ApplyColumnBlock(const int64_t* left, const int64_t* right, int64_t* out, size_t size,
+                             Op op) {
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = op(left[i], right[i]);
+    }
+}
+
+inline void RunColumns(const Program& program, std::span<const std::span<const int64_t>> columns,
+                       std::span<int64_t> out) {
+    size_t num_blocks = program.max_stack + program.num_slots;
+    std::vector<int64_t> scratch(num_blocks * kColumnBlockSize);
+    int64_t* slots = scratch.data() + program.max_stack * kColumnBlockSize;
+    std::vector<const int64_t*> stack(program.max_stack);
+
+    for (size_t begin = 0; begin < out.size(); begin += kColumnBlockSize) {
+        size_t size = std::min(kColumnBlockSize, out.size() - begin);
+        size_t top = 0;
+        for (const auto& instruction : program.code) {
+            int64_t* block = scratch.data() + top * kColumnBlockSize;
+            switch (instruction.code) {
+                case OpCode::kPush:
+                    std::fill(block, block + size, instruction.operand);
+                    stack[top++] = block;
+                    break;
+                case OpCode::kVariable:
+                    stack[top++] = columns[instruction.operand].data() + begin;
+                    break;
+                case OpCode::kLoad:
+                    stack[top++] = slots + instruction.operand * kColumnBlockSize;
+                    break;
+                case OpCode::kStore:
+                    std::copy(stack[top - 1], stack[top - 1] + size,
+                              slots + instruction.operand * kColumnBlockSize);
+                    break;
+                case OpCode::kAdd:
+                case OpCode::kSub:
+                case OpCode::kMul:
+                case OpCode::kDiv: {
+                    --top;
+                    int64_t* result = scratch.data() + (top - 1) * kColumnBlockSize;
+                    const int64_t* left = stack[top - 1];
+                    const int64_t* right = stack[top];
+                    if (instruction.code == OpCode::kAdd) {
+                        ApplyColumnBlock(left, right, result, size, std::plus<int64_t>());
+                    } else if (instruction.code == OpCode::kSub) {
+                        ApplyColumnBlock(left, right, result, size, std::minus<int64_t>());
+                    } else if (instruction.code == OpCode::kMul) {
+                        ApplyColumnBlock(left, right, result, size, std::multiplies<int64_t>());
+                    } else {
+                        ApplyColumnBlock(left, right, result, size, std::divides<int64_t>());
+                    }
+                    stack[top - 1] = result;
+                    break;
+                }
+            }
+        }
+        std::copy(stack[0], stack[0] + size, out.begin() + begin);
+    }
+}
+
+// ParserE..ParserT3 report malformed input by leaving an operand out of the tree.
+inline bool IsComplete(const Expression* expr) {
+    if (!expr) {
+        return false;
+    } else if (expr->GetKind() != ExpressionKind::kOperation) {
+        return true;
+    }
+    auto op = static_cast<const Operation*>(expr);
+    return IsComplete(op->GetLeft()) && IsComplete(op->GetRight());
+}
+
+// Parsed, optimized and compiled once; evaluated against any number of bindings. Values are
+// passed in the order of GetVariables().
+class PreparedExpression {
+public:
+    // std::nullopt if text is malformed.
+    static std::optional<PreparedExpression> Create(std::string_view text) {
+        PreparedExpression prepared;
+        ExpressionArena arena;
+        ExpressionArena optimized;
+        BufferTokenizer tok(text);
+        Expression* expr = ParseExpression(&tok, &arena, &prepared.variables_);
+        if (!IsComplete(expr)) {
+            return std::nullopt;
+        }
+        prepared.program_ = Compile(*Optimize(*expr, optimized));
+        return prepared;
+    }
+
+    const std::vector<std::string>& GetVariables() const {
+        return variables_.GetNames();
+    }
+
+    const Program& GetProgram() const {
+        return program_;
+    }
+
+    int64_t Evaluate(Bindings bindings = {}) const {
+        assert(bindings.size() >= variables_.GetNames().size() && "Unbound variable");
+        return Run(program_, bindings);
+    }
+
+    // One column per variable, in the order of GetVariables().
+    void EvaluateColumns(std::span<const std::span<const int64_t>> columns,
+                         std::span<int64_t> out) const {
+        assert(columns.size() >= variables_.GetNames().size() && "Unbound variable");
+        RunColumns(program_, columns, out);
+    }
+
+private:
+    PreparedExpression() = default;
+
+    VariableTable variables_;
+    Program program_;
+};
+
+// Key under which equivalent spellings of an expression are cached: characters the tokenizers
+// skip are dropped, except that one space is kept where they separate two numbers or names.
+inline std::string NormalizeExpression(std::string_view text) {
+    std::string key;
+    key.reserve(text.size());
+    bool separated = false;
+    for (char c : text) {
+        if (IsNameChar(c)) {
+            if (separated && !key.empty() && IsNameChar(key.back())) {
+                key.push_back(' ');
+            }
+            key.push_back(c);
+            separated = false;
+        } else if (IsOperation(c) || IsScope(c)) {
+            key.push_back(c);
+            separated = false;
+        } else {
+            separated = true;
+        }
+    }
+    return key;
+}
+
+// Thread-safe LRU cache of prepared expressions keyed by normalized text. The result of a
+// variable-free expression is cached too, once Evaluate has computed it without trapping, so
+// Prepare("1/0") only compiles. Malformed text is cached as an entry without an expression, so
+// repeating it costs a lookup. Entries are spread over independently locked shards, and each
+// shard evicts its least recently used entries once it holds more than its share of max_bytes.
+class ExpressionCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    static constexpr size_t kDefaultMaxBytes = 64 << 20;
+    static constexpr size_t kDefaultShards = 16;
+
+    explicit ExpressionCache(size_t max_bytes = kDefaultMaxBytes,
+                             size_t num_shards = kDefaultShards)
+        : shard_max_bytes_(max_bytes / num_shards), shards_(num_shards) {
+    }
+
+    // nullptr if text is malformed.
+    std::shared_ptr<const PreparedExpression> Prepare(std::string_view text) {
+        std::string key = NormalizeExpression(text);
+        return Lookup(key, GetShard(key)).expr;
+    }
+
+    // std::nullopt if text is malformed.
+    std::optional<int64_t> Evaluate(std::string_view text, Bindings bindings = {}) {
+        std::string key = NormalizeExpression(text);
+        Shard& shard = GetShard(key);
+        Entry entry = Lookup(key, shard);
+        if (entry.has_value) {
+            return entry.value;
+        } else if (!entry.expr) {
+            return std::nullopt;
+        }
+        int64_t value = entry.expr->Evaluate(bindings);
+        if (entry.expr->GetVariables().empty()) {
+            std::lock_guard lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end() && it->second->entry.expr == entry.expr) {
+                it->second->entry.has_value = true;
+                it->second->entry.value = value;
+            }
+        }
+        return value;
+    }
+
+    Stats GetStats() const {
+        Stats stats;
+        for (const auto& shard : shards_) {
+            std::lock_guard lock(shard.mutex);
+            stats.hits += shard.hits;
+            stats.misses += shard.misses;
+            stats.entries += shard.lru.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const PreparedExpression> expr;
+        bool has_value = false;
+        int64_t value = 0;
+    };
+
+    struct Node {
+        std::string key;
+        Entry entry;
+        size_t bytes;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Node> lru;
+        std::unordered_map<std::string_view, std::list<Node>::iterator> index;
+        size_t bytes = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+
+    static size_t EstimateBytes(const std::string& key, const PreparedExpression* expr) {
+        size_t bytes = sizeof(Node) + 2 * key.size();
+        if (!expr) {
+            return bytes;
+        }
+        bytes += sizeof(PreparedExpression) + expr->GetProgram().code.size() * sizeof(Instruction);
+        for (const auto& name : expr->GetVariables()) {
+            bytes += 2 * (sizeof(std::string) + name.size());
+        }
+        return bytes;
+    }
+
+    Shard& GetShard(const std::string& key) {
+        return shards_[std::hash<std::string>()(key) % shards_.size()];
+    }
+
+    Entry Lookup(const std::string& key, Shard& shard) {
+        {
+            std::lock_guard lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end()) {
+                ++shard.hits;
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                return it->second->entry;
+            }
+            ++shard.misses;
+        }
+
+        // Compile outside the lock so that a slow miss does not stall the whole shard.
+        Entry entry;
+        if (auto prepared = PreparedExpression::Create(key)) {
+            entry.expr = std::make_shared<const PreparedExpression>(std::move(*prepared));
+        }
+        size_t bytes = EstimateBytes(key, entry.expr.get());
+
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            return it->second->entry;
+        }
+        shard.lru.push_front({key, entry, bytes});
+        shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+        shard.bytes += bytes;
+        while (shard.bytes > shard_max_bytes_ && shard.lru.size() > 1) {
+            shard.bytes -= shard.lru.back().bytes;
+            shard.index.erase(shard.lru.back().key);
+            shard.lru.pop_back();
+        }
+        return entry;
+    }
+
+    size_t shard_max_bytes_;
+    std::vector<Shard> shards_;
+};
+
+// Compile-time counterpart of the parser. A string literal is parsed during constant
+// evaluation, by the same LL(1) procedures as ParserE..ParserT3 over a BufferTokenizer, into a
+// fixed-size node table. The table is then turned into an expression-template type, so
+// evaluation compiles down to straight-line arithmetic with no allocation or virtual calls:
+//
+//     int64_t values[] = {x, y};
+//     int64_t result = StaticFormula<"(x + 1) * y">::Evaluate(values);
+//
+// Variables are numbered by first appearance, as in PreparedExpression, which remains the path
+// for strings that are only known at runtime.
+template <size_t N>
+struct FixedString {
+    char data[N] = {};
+
+    constexpr FixedString(const char (&text)[N]) {
+        std::copy(text, text + N, data);
+    }
+
+    constexpr std::string_view View() const {
+        return std::string_view(data, N - 1);
+    }
+};
+
+struct StaticNode {
+    ExpressionKind kind = ExpressionKind::kConst;
+    char op_type = 0;
+    int64_t value = 0;
+    int left = -1;
+    int right = -1;
+};
+
+// Every token adds at most two nodes (unary minus adds a zero), and there are fewer tokens
+// than characters.
+template <size_t N>
+struct StaticTree {
+    StaticNode nodes[2 * N] = {};
+    int size = 0;
+    int root = -1;
+    bool valid = true;
+    std::string_view variables[N] = {};
+    size_t num_variables = 0;
+
+    constexpr int Add(StaticNode node) {
+        nodes[size] = node;
+        return size++;
+    }
+
+    constexpr int AddConst(int64_t value) {
+        return Add({ExpressionKind::kConst, 0, value, -1, -1});
+    }
+
+    constexpr int AddVariable(std::string_view name) {
+        size_t index = 0;
+        while (index < num_variables && variables[index] != name) {
+            ++index;
+        }
+        if (index == num_variables) {
+            variables[num_variables++] = name;
+        }
+        return Add({ExpressionKind::kVariable, 0, static_cast<int64_t>(index), -1, -1});
+    }
+
+    constexpr int AddOperation(char op_type, int left, int right) {
+        if (left < 0 || right < 0) {
+            valid = false;
+        }
+        return Add({ExpressionKind::kOperation, op_type, 0, left, right});
+    }
+};
+
+template <size_t N>
+constexpr int StaticParserE(BufferTokenizer* tok, StaticTree<N>* tree);
+template <size_t N>
+constexpr int StaticParserT1(BufferTokenizer* tok, StaticTree<N>* tree);
+template <size_t N>
+constexpr int StaticParserT2(BufferTokenizer* tok, StaticTree<N>* tree);
+template <size_t N>
+constexpr int StaticParserT3(BufferTokenizer* tok, StaticTree<N>* tree);
+
+template <size_t N>
+constexpr int StaticParserE(BufferTokenizer* tok, StaticTree<N>* tree) {
+    int left = StaticParserT1(tok, tree);
+    while (tok->GetType() == Tokenizer::TokenType::kSymbol &&
+           (tok->GetSymbol() == '-' || tok->GetSymbol() == '+')) {
+        auto op = tok->GetSymbol();
+        int right = StaticParserT1(tok, tree);
+        left = tree->AddOperation(op, left, right);
+    }
+    return left;
+}
+
+template <size_t N>
+constexpr int StaticParserT1(BufferTokenizer* tok, StaticTree<N>* tree) {
+    int left = StaticParserT2(tok, tree);
+    tok->Consume();
+    while (tok->GetType() == Tokenizer::TokenType::kSymbol &&
+           (tok->GetSymbol() == '*' || tok->GetSymbol() == '/')) {
+        auto op = tok->GetSymbol();
+        int right = StaticParserT2(tok, tree);
+        left = tree->AddOperation(op, left, right);
+        tok->Consume();
+    }
+    return left;
+}
+
+template <size_t N>
+constexpr int StaticParserT2(BufferTokenizer* tok, StaticTree<N>* tree) {
+    if (tok->NextSub()) {
+        int left = tree->AddConst(0);
+        tok->Consume();
+        int right = StaticParserT3(tok, tree);
+        return tree->AddOperation('-', left, right);
+    } else {
+        return StaticParserT3(tok, tree);
+    }
+}
+
+template <size_t N>
+constexpr int StaticParserT3(BufferTokenizer* tok, StaticTree<N>* tree) {
+    tok->Consume();
+    if (tok->GetType() == Tokenizer::TokenType::kNumber) {
+        return tree->AddConst(tok->GetNumber());
+    } else if (tok->GetType() == Tokenizer::TokenType::kName) {
+        return tree->AddVariable(tok->GetName());
+    } else if (tok->GetType() == Tokenizer::TokenType::kSymbol &&
+               (tok->GetSymbol() == '(' || tok->GetSymbol() == ')')) {
+        return StaticParserE(tok, tree);
+    }
+    return -1;
+}
+
+template <size_t N>
+constexpr StaticTree<N> ParseStaticExpression(std::string_view text) {
+    StaticTree<N> tree;
+    BufferTokenizer tok(text);
+    tok.SetNames(true);
+    tree.root = StaticParserE(&tok, &tree);
+    if (tree.root < 0) {
+        tree.valid = false;
+    }
+    return tree;
+}
+
+template <int64_t Value>
+struct StaticConst {
+    static constexpr int64_t Evaluate(Bindings) {
+        return Value;
+    }
+};
+
+template <size_t Index>
+struct StaticVariable {
+    static constexpr int64_t Evaluate(Bindings bindings) {
+        return bindings[Index];
+    }
+};
+
+template <char OpType, class Left, class Right>
+struct StaticOperation {
+    static constexpr int64_t Evaluate(Bindings bindings) {
+        return ApplyOperation(OpType, Left::Evaluate(bindings), Right::Evaluate(bindings));
+    }
+};
+
+template <const auto& Tree, int Index>
+constexpr auto MakeStaticNode() {
+    constexpr StaticNode node = Tree.nodes[Index];
+    if constexpr (node.kind == ExpressionKind::kConst) {
+        return StaticConst<node.value>();
+    } else if constexpr (node.kind == ExpressionKind::kVariable) {
+        return StaticVariable<static_cast<size_t>(node.value)>();
+    } else {
+        using Left = decltype(MakeStaticNode<Tree, node.left>());
+        using Right = decltype(MakeStaticNode<Tree, node.right>());
+        return StaticOperation<node.op_type, Left, Right>();
+    }
+}
+
+template <FixedString Text>
+struct StaticFormula {
+    static constexpr auto kTree = ParseStaticExpression<sizeof(Text.data)>(Text.View());
+    static_assert(kTree.valid, "Malformed expression");
+
+    using Type = decltype(MakeStaticNode<kTree, kTree.root>());
+
+    static constexpr size_t GetVariableCount() {
+        return kTree.num_variables;
+    }
+
+    static constexpr std::string_view GetVariable(size_t index) {
+        return kTree.variables[index];
+    }
+
+    static constexpr int64_t Evaluate(Bindings bindings = {}) {
+        assert(bindings.size() >= kTree.num_variables && "Unbound variable");
+        return Type::Evaluate(bindings);
+    }
+};
+
+// Operator-precedence (shunting-yard) form of the ParserE..ParserT3 grammar, fed one token at a
+// time and using heap stacks instead of recursion. Builder turns operands and operators into
+// results and is either ValueBuilder (evaluate on the fly) or TreeBuilder (build nodes); an
+// operation that the builder cannot apply makes the expression malformed.
+// max_depth bounds the nesting of scopes and unary minus; deeper input is malformed.
+constexpr size_t kDefaultMaxDepth = 1 << 16;
+
+template <class Builder>
+class PrecedenceParser {
+public:
+    using Operand = typename Builder::Operand;
+
+    explicit PrecedenceParser(Builder builder, size_t max_depth = kDefaultMaxDepth)
+        : builder_(builder), max_depth_(max_depth) {
+    }
+
+    ~PrecedenceParser() {
+        Clear();
+    }
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    void Fail() {
+        failed_ = true;
+    }
+
+    void PushOperand(Operand operand) {
+        if (failed_ || !expect_operand_) {
+            builder_.Discard(operand);
+            failed_ = true;
+            return;
+        }
+        operands_.push_back(operand);
+        ApplyNegations();
+        expect_operand_ = false;
+    }
+
+    void PushOperation(char op_type) {
+        if (failed_) {
+            return;
+        }
+        if (expect_operand_) {
+            if (op_type == '-') {
+                PushNested(kNegate);
+            } else {
+                failed_ = true;
+            }
+            return;
+        }
+        while (!ops_.empty() && IsOperation(ops_.back()) &&
+               GetPrecedence(ops_.back()) >= GetPrecedence(op_type)) {
+            Reduce();
+        }
+        ops_.push_back(op_type);
+        expect_operand_ = true;
+    }
+
+    void OpenScope() {
+        if (failed_ || !expect_operand_) {
+            failed_ = true;
+            return;
+        }
+        PushNested('(');
+    }
+
+    void CloseScope() {
+        if (failed_ || expect_operand_) {
+            failed_ = true;
+            return;
+        }
+        while (!ops_.empty() && ops_.back() != '(') {
+            Reduce();
+        }
+        if (ops_.empty()) {
+            failed_ = true;
+            return;
+        }
+        PopNested();
+        ApplyNegations();
+    }
+
+    // Completes the expression fed so far and resets the parser for the next one.
+    std::optional<Operand> Finish() {
+        std::optional<Operand> result;
+        if (!failed_ && !expect_operand_) {
+            // Like the LL(1) parser, unclosed scopes are closed by the end of input.
+            while (!ops_.empty() && !failed_) {
+                if (ops_.back() == '(') {
+                    PopNested();
+                    ApplyNegations();
+                } else {
+                    Reduce();
+                }
+            }
+            if (!failed_) {
+                result = operands_.back();
+                operands_.pop_back();
+            }
+        }
+        Clear();
+        return result;
+    }
+
+private:
+    static constexpr char kNegate = 'u';
+
+    static int GetPrecedence(char op_type) {
+        return op_type == '*' || op_type == '/' ? 2 : 1;
+    }
+
+    void PushNested(char op_type) {
+        if (++depth_ > max_depth_) {
+            failed_ = true;
+            return;
+        }
+        ops_.push_back(op_type);
+    }
+
+    void PopNested() {
+        ops_.pop_back();
+        --depth_;
+    }
+
+    // Unary minus binds to the primary that follows it, as in ParserT2.
+    void ApplyNegations() {
+        while (!failed_ && !ops_.empty() && ops_.back() == kNegate) {
+            PopNested();
+            if (!builder_.Negate(operands_.back(), &operands_.back())) {
+                failed_ = true;
+            }
+        }
+    }
+
+    void Reduce() {
+        char op_type = ops_.back();
+        ops_.pop_back();
+        Operand right = operands_.back();
+        operands_.pop_back();
+        if (!builder_.Apply(op_type, operands_.back(), right, &operands_.back())) {
+            failed_ = true;
+        }
+    }
+
+    void Clear() {
+        for (auto operand : operands_) {
+            builder_.Discard(operand);
+        }
+        operands_.clear();
+        ops_.clear();
+        depth_ = 0;
+        expect_operand_ = true;
+        failed_ = false;
+    }
+
+    Builder builder_;
+    size_t max_depth_;
+    size_t depth_ = 0;
+    std::vector<Operand> operands_;
+    std::vector<char> ops_;
+    bool expect_operand_ = true;
+    bool failed_ = false;
+};
+
+// Checked, so that division by zero and overflow make the expression malformed instead of
+// trapping on untrusted input.
+struct ValueBuilder {
+    using Operand = int64_t;
+
+    bool Apply(char op_type, int64_t left, int64_t right, int64_t* result) {
+        return (op_type != '/' || right != 0) && ApplyNarrow(op_type, left, right, result);
+    }
+
+    bool Negate(int64_t value, int64_t* result) {
+        return Apply('-', 0, value, result);
+    }
+
+    void Discard(int64_t) {
+    }
+};
+
+// Builds the same nodes as ParserE..ParserT3, including 0 - x for unary minus.
+struct TreeBuilder {
+    using Operand = Expression*;
+
+    bool Apply(char op_type, Expression* left, Expression* right, Expression** result) {
+        *result = MakeOperation(arena, op_type, left, right);
+        return true;
+    }
+
+    bool Negate(Expression* expr, Expression** result) {
+        *result = MakeOperation(arena, '-', MakeConst(arena, 0), expr);
+        return true;
+    }
+
+    void Discard(Expression* expr) {
+        if (!arena) {
+            delete expr;
+        }
+    }
+
+    ExpressionArena* arena;
+};
+
+// Feeds the tokens of one expression to parser and completes it. make_operand turns the
+// current number or name token into an operand. The parser is reset afterwards and can be
+// reused, which keeps its stacks allocated between expressions.
+template <class Tok, class Builder, class MakeOperand>
+std::optional<typename Builder::Operand> ParseTokens(Tok* tok, PrecedenceParser<Builder>* parser,
+                                                     MakeOperand make_operand) {
+    for (tok->Consume(); tok->GetType() != Tokenizer::TokenType::kEnd && !parser->Failed();
+         tok->Consume()) {
+        if (tok->GetType() == Tokenizer::TokenType::kNumber ||
+            tok->GetType() == Tokenizer::TokenType::kName) {
+            parser->PushOperand(make_operand(*tok));
+        } else if (tok->GetSymbol() == '(') {
+            parser->OpenScope();
+        } else if (tok->GetSymbol() == ')') {
+            parser->CloseScope();
+        } else {
+            parser->PushOperation(tok->GetSymbol());
+        }
+    }
+    return parser->Finish();
+}
+
+// Parses one expression with parser, whose builder allocates in arena, or on the heap without
+// one. The parser is reset afterwards and can be reused, which keeps its stacks allocated
+// between expressions.
+template <class Tok>
+Expression* ParseExpressionIterative(Tok* tok, PrecedenceParser<TreeBuilder>* parser,
+                                     ExpressionArena* arena, VariableTable* variables = nullptr) {
+    // Letters are skipped without a table, as in ParserE, so names always resolve.
+    tok->SetNames(variables != nullptr);
+    auto make_operand = [arena, variables](Tok& token) {
+        if (token.GetType() == Tokenizer::TokenType::kNumber) {
+            return MakeConst(arena, token.GetNumber());
+        }
+        return MakeVariable(arena, variables->Resolve(token.GetName()));
+    };
+    return ParseTokens(tok, parser, make_operand).value_or(nullptr);
+}
+
+// Non-recursive alternative to ParseExpression for untrusted, deeply nested input. Produces the
+// same tree on well-formed input; returns nullptr for malformed input or nesting deeper than
+// max_depth. The result is owned by arena and stays valid until its next Reset.
+template <class Tok>
+Expression* ParseExpressionIterative(Tok* tok, ExpressionArena& arena,
+                                     VariableTable* variables = nullptr,
+                                     size_t max_depth = kDefaultMaxDepth) {
+    PrecedenceParser<TreeBuilder> parser(TreeBuilder{&arena}, max_depth);
+    return ParseExpressionIterative(tok, &parser, &arena, variables);
+}
+
+// The same with a result owned by the caller.
+template <class Tok>
+std::unique_ptr<Expression> ParseExpressionIterative(Tok* tok, VariableTable* variables = nullptr,
+                                                     size_t max_depth = kDefaultMaxDepth) {
+    PrecedenceParser<TreeBuilder> parser(TreeBuilder{nullptr}, max_depth);
+    return std::unique_ptr<Expression>(ParseExpressionIterative(tok, &parser, nullptr, variables));
+}
+
+// Number of lines a worker takes from the shared queue at a time.
+constexpr size_t kBatchChunkSize = 1024;
+
+// Evaluates newline-separated expressions on num_threads workers (all cores if 0) and returns
+// one result per line of SplitExpressions, std::nullopt for lines that do not parse (including
+// empty ones), divide by zero or overflow. Workers pull fixed-size chunks of lines from a shared
+// counter and evaluate while parsing, with one reused ValueBuilder parser each, so no tree is
+// built, nothing recurses and the global heap is not touched.
+inline std::vector<std::optional<int64_t>> EvaluateBatch(std::string_view buffer,
+                                                         size_t num_threads = 0) {
+    auto lines = SplitExpressions(buffer);
+    std::vector<std::optional<int64_t>> results(lines.size());
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t num_chunks = (lines.size() + kBatchChunkSize - 1) / kBatchChunkSize;
+    num_threads = std::min(num_threads, num_chunks);
+
+    std::atomic<size_t> next_chunk = 0;
+    auto worker = [&] {
+        PrecedenceParser<ValueBuilder> parser(ValueBuilder(), kDefaultMaxDepth);
+        auto make_operand = [](BufferTokenizer& token) { return token.GetNumber(); };
+        for (size_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++) {
+            size_t end = std::min(lines.size(), (chunk + 1) * kBatchChunkSize);
+            for (size_t i = chunk * kBatchChunkSize; i < end; ++i) {
+                BufferTokenizer tok(lines[i]);
+                results[i] = ParseTokens(&tok, &parser, make_operand);
+            }
+        }
+    };
+
+    if (num_threads <= 1) {
+        worker();
+        return results;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (size_t i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+
+// Non-recursive counterpart of Expression::Evaluate. Returns std::nullopt if the tree is deeper
+// than max_depth. Unlike the parser's limit this counts tree levels, so a flat sum of n terms is
+// n levels deep; frames live on the heap, hence there is no limit by default.
+inline std::optional<int64_t> EvaluateIterative(
+    const Expression& expr, Bindings bindings = {},
+    size_t max_depth = std::numeric_limits<size_t>::max()) {
+    struct Frame {
+        const Expression* expr;
+        size_t depth;
+        bool expanded;
+    };
+    std::vector<Frame> frames = {{&expr, 0, false}};
+    std::vector<int64_t> values;
+    while (!frames.empty()) {
+        Frame frame = frames.back();
+        frames.pop_back();
+        if (frame.expr->GetKind() == ExpressionKind::kConst) {
+            values.push_back(static_cast<const Const*>(frame.expr)->GetValue());
+        } else if (frame.expr->GetKind() == ExpressionKind::kVariable) {
+            values.push_back(bindings[static_cast<const Variable*>(frame.expr)->GetIndex()]);
+        } else if (frame.expanded) {
+            int64_t right = values.back();
+            values.pop_back();
+            auto op = static_cast<const Operation*>(frame.expr);
+            values.back() = ApplyOperation(op->GetOpType(), values.back(), right);
+        } else {
+            if (frame.depth >= max_depth) {
+                return std::nullopt;
+            }
+            auto op = static_cast<const Operation*>(frame.expr);
+            frames.push_back({frame.expr, frame.depth, true});
+            frames.push_back({op->GetRight(), frame.depth + 1, false});
+            frames.push_back({op->GetLeft(), frame.depth + 1, false});
+        }
+    }
+    return values.back();
+}
+
+// Push-based evaluator for input that arrives in arbitrary chunks (e.g. from a socket).
+// Expressions are separated by newlines; Feed accepts any part of the stream and reports each
+// expression as soon as its newline arrives, with std::nullopt for malformed ones and for those
+// that divide by zero or overflow. Operators are reduced as soon as precedence allows, so state
+// is bounded by the nesting depth of the current expression and no text is buffered. Names are
+// not supported here.
+class StreamingEvaluator {
+public:
+    using Callback = std::function<void(std::optional<int64_t>)>;
+
+    explicit StreamingEvaluator(Callback callback, size_t max_depth = kDefaultMaxDepth)
+        : callback_(std::move(callback)), parser_(ValueBuilder(), max_depth) {
+    }
+
+    void Feed(std::string_view chunk) {
+        for (char c : chunk) {
+            if (c >= '0' && c <= '9') {
+                if (!in_number_) {
+                    in_number_ = true;
+                    number_ = 0;
+                }
+                number_ = number_ * 10 + static_cast<uint64_t>(c - '0');
+                has_tokens_ = true;
+                continue;
+            }
+            if (in_number_) {
+                in_number_ = false;
+                parser_.PushOperand(static_cast<int64_t>(number_));
+            }
+            if (c == '\n') {
+                FinishExpression();
+            } else if (IsOperation(c)) {
+                parser_.PushOperation(c);
+            } else if (c == '(') {
+                parser_.OpenScope();
+            } else if (c == ')') {
+                parser_.CloseScope();
+            } else if (IsNameStart(c)) {
+                parser_.Fail();
+            }
+            has_tokens_ = has_tokens_ || IsOperation(c) || IsScope(c) || IsNameStart(c);
+        }
+    }
+
+    // Reports the last expression if the input did not end with a newline.
+    void Finish() {
+        Feed("\n");
+    }
+
+private:
+    void FinishExpression() {
+        auto result = parser_.Finish();
+        if (has_tokens_) {
+            callback_(result);
+        }
+        has_tokens_ = false;
+    }
+
+    Callback callback_;
+    PrecedenceParser<ValueBuilder> parser_;
+    uint64_t number_ = 0;
+    bool in_number_ = false;
+    bool has_tokens_ = false;
+};
+
+// Checked evaluation. Every operation is guarded by __builtin_*_overflow, so the common case
+// costs one extra branch. An operation that overflows int64_t is redone in 128 bits and only
+// its ancestors see the wide value; results that fit int64_t again drop back to the fast path.
+// Division by zero and overflow of the 128-bit range are reported instead of trapping.
+__extension__ typedef __int128 WideInt;
+
+enum class EvaluationStatus { kOk, kDivisionByZero, kOverflow };
+
+struct CheckedResult {
+    EvaluationStatus status = EvaluationStatus::kOk;
+    WideInt value = 0;
+
+    bool IsNarrow() const {
+        return value >= std::numeric_limits<int64_t>::min() &&
+               value <= std::numeric_limits<int64_t>::max();
+    }
+};
+
+struct CheckedValue {
+    int64_t narrow = 0;
+    WideInt wide = 0;
+    bool is_wide = false;
+};
+
+inline bool ApplyWide(char op_type, WideInt left, WideInt right, WideInt* result) {
+    switch (op_type) {
+        case '*':
+            return !__builtin_mul_overflow(left, right, result);
+        case '/':
+            if (right == -1) {
+                return !__builtin_sub_overflow(WideInt(0), left, result);
+            }
+            *result = left / right;
+            return true;
+        case '+':
+            return !__builtin_add_overflow(left, right, result);
+        case '-':
+            return !__builtin_sub_overflow(left, right, result);
+        default:
+            assert(!"Unsupported operation");
+            return false;
+    }
+}
+
+inline CheckedValue EvaluateCheckedNode(const Expression* expr, Bindings bindings,
+                                        EvaluationStatus* status) {
+    if (expr->GetKind() == ExpressionKind::kConst) {
+        return {static_cast<const Const*>(expr)->GetValue()};
+    } else if (expr->GetKind() == ExpressionKind::kVariable) {
+        return {bindings[static_cast<const Variable*>(expr)->GetIndex()]};
+    }
+
+    auto op = static_cast<const Operation*>(expr);
+    CheckedValue left = EvaluateCheckedNode(op->GetLeft(), bindings, status);
+    if (*status != EvaluationStatus::kOk) {
+        return {};
+    }
+    CheckedValue right = EvaluateCheckedNode(op->GetRight(), bindings, status);
+    if (*status != EvaluationStatus::kOk) {
+        return {};
+    }
+    if (op->GetOpType() == '/' && (right.is_wide ? right.wide == 0 : right.narrow == 0)) {
+        *status = EvaluationStatus::kDivisionByZero;
+        return {};
+    }
+
+    CheckedValue result;
+    if (!left.is_wide && !right.is_wide &&
+        ApplyNarrow(op->GetOpType(), left.narrow, right.narrow, &result.narrow)) {
+        return result;
+    }
+    WideInt left_wide = left.is_wide ? left.wide : left.narrow;
+    WideInt right_wide = right.is_wide ? right.wide : right.narrow;
+    if (!ApplyWide(op->GetOpType(), left_wide, right_wide, &result.wide)) {
+        *status = EvaluationStatus::kOverflow;
+        return {};
+    }
+    if (result.wide >= std::numeric_limits<int64_t>::min() &&
+        result.wide <= std::numeric_limits<int64_t>::max()) {
+        result.narrow = static_cast<int64_t>(result.wide);
+    } else {
+        result.is_wide = true;
+    }
+    return result;
+}
+
+inline CheckedResult EvaluateChecked(const Expression& expr, Bindings bindings = {}) {
+    CheckedResult result;
+    CheckedValue value = EvaluateCheckedNode(&expr, bindings, &result.status);
+    if (result.status == EvaluationStatus::kOk) {
+        result.value = value.is_wide ? value.wide : value.narrow;
+    }
+    return result;
+}
@@ -0,0 +1,404 @@
+// Microbenchmarks for calculator.cpp.
+//
+//     g++ -std=c++20 -O2 -pthread calculator_benchmark.cpp -o calculator_benchmark
+//     ./calculator_benchmark [--count=N] [--depth=N] [--width=N] [--mul=P] [--div=P] [--unary=P]
+//                            [--variables=P]
+//
+// A corpus of random expressions is generated from the parameters, then every stage is timed
+// over the whole corpus: tokenizing, parsing and evaluating with each backend. Backends that bind
+// variables run on a second corpus of the same shape in which operands can also be names.
+// Allocations are counted by replacing the global operator new. Each line reports ns per
+// expression, MB/s of input and allocations per expression, so runs can be diffed against a
+// baseline.
+
+#include "calculator.cpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <random>
+
+static std::atomic<size_t> allocations = 0;
+
+// Kept out of line: once GCC inlines both sides it pairs the builtin operator new with free
+// and reports -Wmismatched-new-delete.
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+struct CorpusOptions {
+    size_t count = 100000;
+    // Nesting levels of parenthesized subexpressions.
+    int depth = 3;
+    // Operands per level.
+    int width = 3;
+    // Probabilities of * and / among binary operators; the rest is split between + and -.
+    double mul = 0.3;
+    double div = 0.1;
+    // Probability that an operand is negated.
+    double unary = 0.1;
+    // Probability that an operand is one of kNumVariables names instead of a literal.
+    double variables = 0.3;
+};
+
+constexpr size_t kNumVariables = 8;
+
+class CorpusGenerator {
+public:
+    explicit CorpusGenerator(const CorpusOptions& options) : options_(options) {
+    }
+
+    std::string Generate() {
+        std::string corpus;
+        for (size_t i = 0; i < options_.count; ++i) {
+            AppendExpression(options_.depth, &corpus);
+            corpus.push_back('\n');
+        }
+        return corpus;
+    }
+
+private:
+    // Divisors are always non-zero literals so that every expression is well defined.
+    void AppendExpression(int depth, std::string* out) {
+        for (int i = 0; i < options_.width; ++i) {
+            char op = 0;
+            if (i > 0) {
+                double p = uniform_(rng_);
+                if (p < options_.div) {
+                    op = '/';
+                } else if (p < options_.div + options_.mul) {
+                    op = '*';
+                } else {
+                    op = p < (1 + options_.div + options_.mul) / 2 ? '+' : '-';
+                }
+                *out += ' ';
+                *out += op;
+                *out += ' ';
+            }
+            if (uniform_(rng_) < options_.unary) {
+                out->push_back('-');
+            }
+            if (op != '/' && depth > 0 && uniform_(rng_) < 0.5) {
+                out->push_back('(');
+                AppendExpression(depth - 1, out);
+                out->push_back(')');
+            } else if (op != '/' && uniform_(rng_) < options_.variables) {
+                out->push_back(static_cast<char>('a' + variable_(rng_)));
+            } else {
+                *out += std::to_string(digit_(rng_));
+            }
+        }
+    }
+
+    CorpusOptions options_;
+    std::mt19937_64 rng_{42};
+    std::uniform_real_distribution<double> uniform_{0, 1};
+    std::uniform_int_distribution<int> digit_{1, 99};
+    std::uniform_int_distribution<int> variable_{0, kNumVariables - 1};
+};
+
+struct Result {
+    double seconds;
+    size_t allocations;
+};
+
+template <class F>
+Result Measure(F&& body) {
+    size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    return {std::chrono::duration<double>(end - start).count(), allocations.load() - before};
+}
+
+void Report(const std::string& name, const Result& result, size_t count, size_t bytes) {
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setprecision(1) << std::setw(10) << result.seconds * 1e9 / count
+              << " ns/expr" << std::setw(10) << bytes / result.seconds / 1e6 << " MB/s"
+              << std::setprecision(2) << std::setw(10)
+              << static_cast<double>(result.allocations) / count << " allocs/expr\n";
+}
+
+// Keeps results alive so the optimizer cannot drop the measured work.
+static volatile int64_t sink;
+
+int main(int argc, char** argv) {
+    CorpusOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&arg] { return std::string(arg.substr(arg.find('=') + 1)); };
+        if (arg.starts_with("--count=")) {
+            options.count = std::stoul(value());
+        } else if (arg.starts_with("--depth=")) {
+            options.depth = std::stoi(value());
+        } else if (arg.starts_with("--width=")) {
+            options.width = std::stoi(value());
+        } else if (arg.starts_with("--mul=")) {
+            options.mul = std::stod(value());
+        } else if (arg.starts_with("--div=")) {
+            options.div = std::stod(value());
+        } else if (arg.starts_with("--unary=")) {
+            options.unary = std::stod(value());
+        } else if (arg.starts_with("--variables=")) {
+            options.variables = std::stod(value());
+        } else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    CorpusOptions constant_options = options;
+    constant_options.variables = 0;
+    std::string corpus = CorpusGenerator(constant_options).Generate();
+    auto lines = SplitExpressions(corpus);
+    size_t count = lines.size();
+    size_t bytes = corpus.size();
+    std::cout << "corpus: " << count << " expressions, " << bytes << " bytes, depth "
+              << options.depth << ", width " << options.width << "\n";
+
+    Report("Tokenizer::Consume", Measure([&] {
+               std::stringstream in(corpus);
+               Tokenizer tok(&in);
+               int64_t tokens = 0;
+               for (tok.Consume(); tok.GetType() != Tokenizer::TokenType::kEnd; tok.Consume()) {
+                   ++tokens;
+               }
+               sink = tokens;
+           }),
+           count, bytes);
+
+    Report("BufferTokenizer::Consume", Measure([&] {
+               BufferTokenizer tok(corpus);
+               int64_t tokens = 0;
+               for (tok.Consume(); tok.GetType() != Tokenizer::TokenType::kEnd; tok.Consume()) {
+                   ++tokens;
+               }
+               sink = tokens;
+           }),
+           count, bytes);
+
+    Report("ParseExpression", Measure([&] {
+               for (auto line : lines) {
+                   std::stringstream in{std::string(line)};
+                   Tokenizer tok(&in);
+                   sink = ParseExpression(&tok) != nullptr;
+               }
+           }),
+           count, bytes);
+
+    Report("ParseExpression (arena)", Measure([&] {
+               ExpressionArena arena;
+               for (auto line : lines) {
+                   arena.Reset();
+                   BufferTokenizer tok(line);
+                   sink = ParseExpression(&tok, &arena) != nullptr;
+               }
+           }),
+           count, bytes);
+
+    Report("ParseExpressionIterative", Measure([&] {
+               ExpressionArena arena;
+               for (auto line : lines) {
+                   arena.Reset();
+                   BufferTokenizer tok(line);
+                   sink = ParseExpressionIterative(&tok, arena) != nullptr;
+               }
+           }),
+           count, bytes);
+
+    std::vector<std::unique_ptr<Expression>> trees;
+    std::vector<Program> programs;
+    for (auto line : lines) {
+        BufferTokenizer tok(line);
+        trees.push_back(ParseExpression(&tok));
+        programs.push_back(Compile(*trees.back()));
+    }
+
+    Report("Expression::Evaluate", Measure([&] {
+               for (auto& tree : trees) {
+                   sink = tree->Evaluate();
+               }
+           }),
+           count, bytes);
+
+    Report("EvaluateIterative", Measure([&] {
+               for (auto& tree : trees) {
+                   sink = EvaluateIterative(*tree).value_or(0);
+               }
+           }),
+           count, bytes);
+
+    Report("Expression::Evaluate (trace)", Measure([&] {
+               TraceCollector trace;
+               for (auto& tree : trees) {
+                   trace.Clear();
+                   sink = tree->Evaluate(&trace);
+               }
+           }),
+           count, bytes);
+
+    Report("EvaluateChecked", Measure([&] {
+               for (auto& tree : trees) {
+                   sink = static_cast<int64_t>(EvaluateChecked(*tree).value);
+               }
+           }),
+           count, bytes);
+
+    Report("Run", Measure([&] {
+               for (auto& program : programs) {
+                   sink = Run(program);
+               }
+           }),
+           count, bytes);
+
+    Report("EvaluateBatch", Measure([&] { sink = EvaluateBatch(corpus).size(); }), count, bytes);
+
+    Report("StreamingEvaluator", Measure([&] {
+               int64_t total = 0;
+               StreamingEvaluator evaluator([&total](std::optional<int64_t> value) {
+                   total += value.value_or(0);
+               });
+               evaluator.Feed(corpus);
+               sink = total;
+           }),
+           count, bytes);
+
+    std::string variable_corpus = CorpusGenerator(options).Generate();
+    auto variable_lines = SplitExpressions(variable_corpus);
+    size_t variable_bytes = variable_corpus.size();
+    std::cout << "corpus with variables: " << variable_lines.size() << " expressions, "
+              << variable_bytes << " bytes, variables " << options.variables << "\n";
+
+    // Names are bound by first appearance to the values of one row, or of every row for the
+    // columnar backend. The same table is kept row by row and column by column.
+    constexpr size_t kRows = 256;
+    std::mt19937_64 rng(7);
+    std::uniform_int_distribution<int64_t> value(1, 99);
+    std::vector<int64_t> rows(kRows * kNumVariables);
+    std::vector<int64_t> columns(kRows * kNumVariables);
+    for (size_t r = 0; r < kRows; ++r) {
+        for (size_t i = 0; i < kNumVariables; ++i) {
+            rows[r * kNumVariables + i] = columns[i * kRows + r] = value(rng);
+        }
+    }
+    auto row = [&rows](size_t r) {
+        return Bindings(rows).subspan(r * kNumVariables, kNumVariables);
+    };
+
+    // Each tree numbers its own variables, like PreparedExpression.
+    std::vector<std::unique_ptr<Expression>> variable_trees;
+    std::vector<Program> variable_programs;
+    for (auto line : variable_lines) {
+        VariableTable variables;
+        BufferTokenizer tok(line);
+        variable_trees.push_back(ParseExpression(&tok, &variables));
+        variable_programs.push_back(Compile(*variable_trees.back()));
+    }
+
+    Report("Run (variables)", Measure([&] {
+               for (auto& program : variable_programs) {
+                   sink = Run(program, row(0));
+               }
+           }),
+           count, variable_bytes);
+
+    Report("Optimize", Measure([&] {
+               ExpressionArena arena;
+               for (auto& tree : variable_trees) {
+                   arena.Reset();
+                   sink = Optimize(*tree, arena) != nullptr;
+               }
+           }),
+           count, variable_bytes);
+
+    std::vector<Program> optimized_programs;
+    {
+        ExpressionArena arena;
+        for (auto& tree : variable_trees) {
+            arena.Reset();
+            optimized_programs.push_back(Compile(*Optimize(*tree, arena)));
+        }
+    }
+
+    Report("Run (optimized)", Measure([&] {
+               for (auto& program : optimized_programs) {
+                   sink = Run(program, row(0));
+               }
+           }),
+           count, variable_bytes);
+
+    std::vector<std::unique_ptr<PreparedExpression>> prepared;
+    Report("PreparedExpression", Measure([&] {
+               for (auto line : variable_lines) {
+                   prepared.push_back(
+                       std::make_unique<PreparedExpression>(*PreparedExpression::Create(line)));
+               }
+           }),
+           count, variable_bytes);
+
+    Report("PreparedExpression::Evaluate", Measure([&] {
+               for (auto& expr : prepared) {
+                   sink = expr->Evaluate(row(0));
+               }
+           }),
+           count, variable_bytes);
+
+    std::vector<std::span<const int64_t>> column_spans;
+    for (size_t i = 0; i < kNumVariables; ++i) {
+        column_spans.push_back(Bindings(columns).subspan(i * kRows, kRows));
+    }
+    std::vector<int64_t> out(kRows);
+    Report("EvaluateColumns (per row)", Measure([&] {
+               for (auto& expr : prepared) {
+                   expr->EvaluateColumns(column_spans, out);
+               }
+               sink = out[0];
+           }),
+           count * kRows, variable_bytes);
+
+    ExpressionCache cache;
+    Report("ExpressionCache (miss)", Measure([&] {
+               for (auto line : variable_lines) {
+                   sink = cache.Evaluate(line, row(0)).value_or(0);
+               }
+           }),
+           count, variable_bytes);
+
+    Report("ExpressionCache (hit)", Measure([&] {
+               for (auto line : variable_lines) {
+                   sink = cache.Evaluate(line, row(0)).value_or(0);
+               }
+           }),
+           count, variable_bytes);
+
+    // A fixed formula, compiled once at compile time and once at runtime, over count rows.
+    using Formula = StaticFormula<"(a + 1) * b - c / 3 + -(d * 2)">;
+    PreparedExpression formula = *PreparedExpression::Create("(a + 1) * b - c / 3 + -(d * 2)");
+    Report("StaticFormula::Evaluate", Measure([&] {
+               for (size_t i = 0; i < count; ++i) {
+                   sink = Formula::Evaluate(row(i % kRows));
+               }
+           }),
+           count, variable_bytes);
+
+    Report("PreparedExpression (formula)", Measure([&] {
+               for (size_t i = 0; i < count; ++i) {
+                   sink = formula.Evaluate(row(i % kRows));
+               }
+           }),
+           count, variable_bytes);
+    return 0;
+}
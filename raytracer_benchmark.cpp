@@ -0,0 +1,422 @@
+// Render benchmarks for raytracer_logic.cpp.
+//
+//     g++ -std=c++20 -O2 -pthread -I<include> raytracer_benchmark.cpp -o raytracer_benchmark
+//     ./raytracer_benchmark [--scenes=spheres,mesh,deep,lights] [--sizes=320x240,640x480]
+//                           [--depths=1,4,8] [--threads=1,2,4] [--modes=tiles,packets,wavefront]
+//                           [--repeat=N] [--dir=PATH] [--baseline=FILE] [--tolerance=F]
+//
+// The reference scenes are generated from fixed seeds and written as .obj/.mtl files to --dir,
+// then every combination of scene, size, depth, thread count and mode is rendered like the
+// parallel Render does it. Each run is one CSV line on stdout: time to load the scene and build
+// the BVH, time until the first tile is done, tracing time, rays traced (from RenderStats),
+// Mrays/s, the speedup over the first of the thread counts and the peak of live heap memory,
+// counted by replacing the global operator new. With --baseline the Mrays/s of every run is
+// compared against an earlier output and the exit code is 2 if any run got slower than the
+// tolerance. <include> is the directory of the raytracer headers, scene.h and the rest.
+
+#include "raytracer_logic.cpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <malloc.h>
+#include <map>
+#include <random>
+#include <sstream>
+
+static std::atomic<size_t> live_bytes = 0;
+static std::atomic<size_t> peak_bytes = 0;
+
+void* operator new(size_t size) {
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        size_t live = live_bytes.fetch_add(malloc_usable_size(ptr)) + malloc_usable_size(ptr);
+        size_t peak = peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+        }
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr) {
+        live_bytes.fetch_sub(malloc_usable_size(ptr));
+    }
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+// Writes a scene in the .obj dialect of ReadScene: "S x y z r" is a sphere, "P x y z r g b" a
+// point light, materials come from the .mtl file next to it.
+class SceneWriter {
+public:
+    void AddMaterial(const std::string& name, const Vector& diffuse, double specular,
+                     std::array<double, 3> albedo, double refraction_index = 1) {
+        mtl_ << "newmtl " << name << "\n"
+             << "Ka 0.05 0.05 0.05\n"
+             << "Kd " << diffuse[0] << ' ' << diffuse[1] << ' ' << diffuse[2] << "\n"
+             << "Ks " << specular << ' ' << specular << ' ' << specular << "\n"
+             << "Ns 40\n"
+             << "Ni " << refraction_index << "\n"
+             << "al " << albedo[0] << ' ' << albedo[1] << ' ' << albedo[2] << "\n\n";
+    }
+
+    void UseMaterial(const std::string& name) {
+        obj_ << "usemtl " << name << "\n";
+    }
+
+    // Returns the 1-based index of the vertex.
+    int AddVertex(const Vector& v) {
+        obj_ << "v " << v[0] << ' ' << v[1] << ' ' << v[2] << "\n";
+        return ++vertices_;
+    }
+
+    void AddTriangle(int a, int b, int c) {
+        obj_ << "f " << a << ' ' << b << ' ' << c << "\n";
+    }
+
+    void AddQuad(const Vector& a, const Vector& b, const Vector& c, const Vector& d) {
+        int k = AddVertex(a);
+        AddVertex(b);
+        AddVertex(c);
+        AddVertex(d);
+        AddTriangle(k, k + 1, k + 2);
+        AddTriangle(k, k + 2, k + 3);
+    }
+
+    void AddSphere(const Vector& center, double radius) {
+        obj_ << "S " << center[0] << ' ' << center[1] << ' ' << center[2] << ' ' << radius
+             << "\n";
+    }
+
+    void AddLight(const Vector& position, const Vector& intensity) {
+        obj_ << "P " << position[0] << ' ' << position[1] << ' ' << position[2] << ' '
+             << intensity[0] << ' ' << intensity[1] << ' ' << intensity[2] << "\n";
+    }
+
+    // Writes dir/name.obj and dir/name.mtl and returns the path of the .obj.
+    std::string Save(const std::filesystem::path& dir, const std::string& name) const {
+        std::ofstream(dir / (name + ".mtl")) << mtl_.str();
+        auto path = dir / (name + ".obj");
+        std::ofstream(path) << "mtllib " << name << ".mtl\n" << obj_.str();
+        return path.string();
+    }
+
+private:
+    std::stringstream obj_;
+    std::stringstream mtl_;
+    int vertices_ = 0;
+};
+
+struct BenchmarkScene {
+    std::string name;
+    std::string path;
+    std::array<double, 3> look_from;
+    std::array<double, 3> look_to;
+};
+
+// Floor and a 24x24 grid of spheres: many cheap primitives, mostly primary and shadow rays.
+BenchmarkScene MakeSpheres(const std::filesystem::path& dir) {
+    SceneWriter writer;
+    writer.AddMaterial("floor", {0.6, 0.6, 0.6}, 0.1, {1, 0, 0});
+    writer.AddMaterial("ball", {0.8, 0.3, 0.2}, 0.5, {0.9, 0.1, 0});
+    writer.UseMaterial("floor");
+    writer.AddQuad({-20, 0, -40}, {20, 0, -40}, {20, 0, 10}, {-20, 0, 10});
+    writer.UseMaterial("ball");
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> radius(0.2, 0.5);
+    for (int i = 0; i < 24; ++i) {
+        for (int j = 0; j < 24; ++j) {
+            double r = radius(rng);
+            writer.AddSphere({i * 1.2 - 14, r, -j * 1.2 - 2}, r);
+        }
+    }
+    writer.AddLight({0, 20, 0}, {0.8, 0.8, 0.8});
+    writer.AddLight({-10, 8, -10}, {0.3, 0.3, 0.4});
+    return {"spheres", writer.Save(dir, "spheres"), {0, 6, 6}, {0, 0, -15}};
+}
+
+// A 200x200 height field of 80000 triangles: BVH build time and traversal of a deep tree.
+BenchmarkScene MakeMesh(const std::filesystem::path& dir) {
+    constexpr int kCells = 200;
+    SceneWriter writer;
+    writer.AddMaterial("ground", {0.4, 0.6, 0.3}, 0.2, {1, 0, 0});
+    writer.UseMaterial("ground");
+    std::mt19937_64 rng(2);
+    std::uniform_real_distribution<double> phase(0, 2 * std::numbers::pi);
+    double phases[4] = {phase(rng), phase(rng), phase(rng), phase(rng)};
+    for (int i = 0; i <= kCells; ++i) {
+        for (int j = 0; j <= kCells; ++j) {
+            double x = i * 0.1 - 10;
+            double z = -j * 0.1;
+            double y = 0.6 * std::sin(x * 0.7 + phases[0]) * std::cos(z * 0.5 + phases[1]) +
+                       0.15 * std::sin(x * 3.1 + phases[2]) * std::sin(z * 2.7 + phases[3]);
+            writer.AddVertex({x, y, z});
+        }
+    }
+    for (int i = 0; i < kCells; ++i) {
+        for (int j = 0; j < kCells; ++j) {
+            int k = i * (kCells + 1) + j + 1;
+            writer.AddTriangle(k, k + kCells + 1, k + kCells + 2);
+            writer.AddTriangle(k, k + kCells + 2, k + 1);
+        }
+    }
+    writer.AddLight({0, 10, -5}, {0.7, 0.7, 0.7});
+    writer.AddLight({8, 4, -15}, {0.4, 0.3, 0.2});
+    return {"mesh", writer.Save(dir, "mesh"), {0, 4, 2}, {0, 0, -10}};
+}
+
+// Glass and mirror spheres inside a box of mirrors: every hit spawns secondary rays, so the
+// cost grows with RenderOptions::depth.
+BenchmarkScene MakeDeep(const std::filesystem::path& dir) {
+    SceneWriter writer;
+    writer.AddMaterial("wall", {0.3, 0.3, 0.35}, 0.3, {0.3, 0.7, 0});
+    writer.AddMaterial("mirror", {0.1, 0.1, 0.1}, 0.8, {0.1, 0.9, 0});
+    writer.AddMaterial("glass", {0.1, 0.1, 0.1}, 0.8, {0.05, 0.15, 0.8}, 1.5);
+    writer.UseMaterial("wall");
+    Vector a{-4, -2, 2}, b{4, -2, 2}, c{4, 4, 2}, d{-4, 4, 2};
+    Vector e{-4, -2, -10}, f{4, -2, -10}, g{4, 4, -10}, h{-4, 4, -10};
+    writer.AddQuad(a, e, f, b);
+    writer.AddQuad(d, c, g, h);
+    writer.AddQuad(a, d, h, e);
+    writer.AddQuad(b, f, g, c);
+    writer.AddQuad(e, h, g, f);
+    writer.UseMaterial("glass");
+    std::mt19937_64 rng(3);
+    std::uniform_real_distribution<double> u(-1, 1);
+    for (int i = 0; i < 8; ++i) {
+        writer.AddSphere({u(rng) * 2.5, u(rng) * 1.5, -5 + u(rng) * 3}, 0.7);
+    }
+    writer.UseMaterial("mirror");
+    for (int i = 0; i < 8; ++i) {
+        writer.AddSphere({u(rng) * 2.5, u(rng) * 1.5, -5 + u(rng) * 3}, 0.5);
+    }
+    writer.AddLight({0, 3.5, -4}, {0.8, 0.8, 0.8});
+    return {"deep", writer.Save(dir, "deep"), {0, 1, 1.5}, {0, 0, -6}};
+}
+
+// A few objects under 64 lights: shading and shadow rays dominate.
+BenchmarkScene MakeLights(const std::filesystem::path& dir) {
+    SceneWriter writer;
+    writer.AddMaterial("floor", {0.6, 0.6, 0.6}, 0.2, {1, 0, 0});
+    writer.AddMaterial("ball", {0.7, 0.7, 0.7}, 0.6, {0.8, 0.2, 0});
+    writer.UseMaterial("floor");
+    writer.AddQuad({-10, 0, -20}, {10, 0, -20}, {10, 0, 5}, {-10, 0, 5});
+    writer.UseMaterial("ball");
+    for (int i = 0; i < 5; ++i) {
+        writer.AddSphere({i * 2.0 - 4, 0.8, -6}, 0.8);
+    }
+    std::mt19937_64 rng(4);
+    std::uniform_real_distribution<double> u(0, 1);
+    for (int i = 0; i < 64; ++i) {
+        writer.AddLight({u(rng) * 16 - 8, 1 + u(rng) * 6, -u(rng) * 14},
+                        {u(rng) * 0.05, u(rng) * 0.05, u(rng) * 0.05});
+    }
+    return {"lights", writer.Save(dir, "lights"), {0, 3, 3}, {0, 0.5, -6}};
+}
+
+struct BenchmarkOptions {
+    std::vector<std::string> scenes = {"spheres", "mesh", "deep", "lights"};
+    std::vector<std::pair<int, int>> sizes = {{320, 240}, {640, 480}};
+    std::vector<int> depths = {1, 4, 8};
+    std::vector<int> threads;
+    std::vector<std::string> modes = {"tiles"};
+    int repeat = 1;
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "raytracer_benchmark";
+    std::string baseline;
+    double tolerance = 0.1;
+};
+
+struct Result {
+    double load_seconds;
+    double first_pixel_seconds;
+    double trace_seconds;
+    size_t rays;
+    size_t peak_bytes;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point begin, Clock::time_point end) {
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+// Renders the scene like the parallel Render, with the first tile and the stages timed. The
+// wavefront renderer finishes all pixels at once, so its first pixel is the whole render.
+Result Measure(const BenchmarkScene& scene, const CameraOptions& camera_options,
+               const RenderOptions& render_options, const ParallelOptions& parallel_options) {
+    size_t heap_before = live_bytes.load();
+    peak_bytes = heap_before;
+    RenderStats stats;
+    RenderStatsScope scope(&stats);
+
+    auto start = Clock::now();
+    auto loaded = ReadScene(scene.path);
+    Bvh bvh(loaded);
+    TraceContext context{loaded, bvh, parallel_options.path, nullptr, parallel_options.light};
+    auto loaded_at = Clock::now();
+
+    Transformer transformer(camera_options);
+    Framebuffer framebuffer(camera_options.screen_width, camera_options.screen_height);
+    std::once_flag first_tile;
+    Clock::time_point first_pixel;
+    if (parallel_options.wavefront) {
+        RenderWavefront(context, transformer, render_options, parallel_options, &framebuffer);
+        first_pixel = Clock::now();
+    } else {
+        RenderTiles(context, transformer, render_options, parallel_options, &framebuffer,
+                    [&](const Tile&) {
+                        std::call_once(first_tile, [&] { first_pixel = Clock::now(); });
+                    });
+    }
+    Image img(camera_options.screen_width, camera_options.screen_height);
+    PostProc(img, framebuffer.ToColorMap(), render_options);
+    auto end = Clock::now();
+
+    size_t rays = stats.primary_rays + stats.reflected_rays + stats.refracted_rays +
+                  stats.shadow_rays;
+    return {Seconds(start, loaded_at), Seconds(start, first_pixel), Seconds(loaded_at, end), rays,
+            peak_bytes.load() - heap_before};
+}
+
+template <class T, class F>
+std::vector<T> ParseList(std::string_view text, F&& parse) {
+    std::vector<T> values;
+    while (!text.empty()) {
+        auto comma = std::min(text.find(','), text.size());
+        values.push_back(parse(std::string(text.substr(0, comma))));
+        text.remove_prefix(std::min(comma + 1, text.size()));
+    }
+    return values;
+}
+
+// Mrays/s of every run in an earlier output, keyed by the columns before the timings.
+std::map<std::string, double> ReadBaseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        auto fields = ParseList<std::string>(line, [](std::string s) { return s; });
+        if (fields.size() >= 11) {
+            std::string key = fields[0];
+            for (int k = 1; k < 6; ++k) {
+                key += ',' + fields[k];
+            }
+            baseline[key] = std::stod(fields[10]);
+        }
+    }
+    return baseline;
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    auto to_string = [](std::string s) { return s; };
+    auto to_int = [](const std::string& s) { return std::stoi(s); };
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&arg] { return arg.substr(arg.find('=') + 1); };
+        if (arg.starts_with("--scenes=")) {
+            options.scenes = ParseList<std::string>(value(), to_string);
+        } else if (arg.starts_with("--sizes=")) {
+            options.sizes = ParseList<std::pair<int, int>>(value(), [](const std::string& s) {
+                return std::pair(std::stoi(s), std::stoi(s.substr(s.find('x') + 1)));
+            });
+        } else if (arg.starts_with("--depths=")) {
+            options.depths = ParseList<int>(value(), to_int);
+        } else if (arg.starts_with("--threads=")) {
+            options.threads = ParseList<int>(value(), to_int);
+        } else if (arg.starts_with("--modes=")) {
+            options.modes = ParseList<std::string>(value(), to_string);
+        } else if (arg.starts_with("--repeat=")) {
+            options.repeat = std::max(1, std::stoi(std::string(value())));
+        } else if (arg.starts_with("--dir=")) {
+            options.dir = value();
+        } else if (arg.starts_with("--baseline=")) {
+            options.baseline = value();
+        } else if (arg.starts_with("--tolerance=")) {
+            options.tolerance = std::stod(std::string(value()));
+        } else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    if (options.threads.empty()) {
+        int max_threads = GetNumThreads({});
+        for (int t = 1; t < max_threads; t *= 2) {
+            options.threads.push_back(t);
+        }
+        options.threads.push_back(max_threads);
+    }
+
+    std::filesystem::create_directories(options.dir);
+    std::map<std::string, BenchmarkScene (*)(const std::filesystem::path&)> generators = {
+        {"spheres", MakeSpheres}, {"mesh", MakeMesh}, {"deep", MakeDeep}, {"lights", MakeLights}};
+    std::map<std::string, double> baseline;
+    if (!options.baseline.empty()) {
+        baseline = ReadBaseline(options.baseline);
+    }
+
+    std::cout << "scene,width,height,depth,mode,threads,load_s,first_pixel_s,trace_s,rays,"
+                 "mrays_per_s,speedup,peak_heap_mb\n";
+    int regressions = 0;
+    for (const auto& name : options.scenes) {
+        if (!generators.contains(name)) {
+            std::cerr << "Unknown scene " << name << "\n";
+            return 1;
+        }
+        BenchmarkScene scene = generators[name](options.dir);
+        CameraOptions camera_options(0, 0);
+        camera_options.look_from = scene.look_from;
+        camera_options.look_to = scene.look_to;
+        for (auto [width, height] : options.sizes) {
+            camera_options.screen_width = width;
+            camera_options.screen_height = height;
+            for (int depth : options.depths) {
+                for (const auto& mode : options.modes) {
+                    double first_seconds = 0;
+                    for (int threads : options.threads) {
+                        ParallelOptions parallel_options;
+                        parallel_options.num_threads = threads;
+                        parallel_options.packet_tracing = mode == "packets";
+                        parallel_options.wavefront = mode == "wavefront";
+                        std::optional<Result> best;
+                        for (int k = 0; k < options.repeat; ++k) {
+                            Result result =
+                                Measure(scene, camera_options, {depth}, parallel_options);
+                            if (!best || result.trace_seconds < best->trace_seconds) {
+                                best = result;
+                            }
+                        }
+                        double mrays = best->rays / best->trace_seconds / 1e6;
+                        if (first_seconds == 0) {
+                            first_seconds = best->trace_seconds;
+                        }
+
+                        std::stringstream key;
+                        key << name << ',' << width << ',' << height << ',' << depth << ','
+                            << mode << ',' << threads;
+                        std::cout << key.str() << std::fixed << std::setprecision(4) << ','
+                                  << best->load_seconds << ',' << best->first_pixel_seconds
+                                  << ',' << best->trace_seconds << ',' << best->rays << ','
+                                  << std::setprecision(3) << mrays << ','
+                                  << first_seconds / best->trace_seconds << ','
+                                  << std::setprecision(1) << best->peak_bytes / 1e6 << std::endl;
+
+                        auto it = baseline.find(key.str());
+                        if (it != baseline.end() && mrays < it->second * (1 - options.tolerance)) {
+                            std::cerr << "regression " << key.str() << ": " << mrays
+                                      << " Mrays/s, baseline " << it->second << "\n";
+                            ++regressions;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return regressions ? 2 : 0;
+}
@@ -13,137 +13,2427 @@
 #include <cmath>
 #include <transformer.h>
 #include <postprocessing.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cassert>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 
-void RayCast(const Scene& scene, const Ray& view_ray, RenderOptions opt, Vector& result);
+// Counters of the work done while rendering. They are only collected on threads with a
+// RenderStatsScope; ParallelFor and the tile renderer hand them on to their worker threads and
+// merge the workers' counters when they finish.
+struct RenderStats {
+    size_t primary_rays = 0;
+    size_t reflected_rays = 0;
+    size_t refracted_rays = 0;
+    size_t shadow_rays = 0;
+    // Shadow rays that found an occluder.
+    size_t shadowed = 0;
+    // Exact GetIntersection tests, after the BVH and the packed prefilter.
+    size_t triangle_tests = 0;
+    size_t sphere_tests = 0;
+    // Shaded kFull hits and the sum of their depths: 1 for primary hits, 2 for the hits of
+    // their secondary rays and so on.
+    size_t shaded_hits = 0;
+    size_t depth_sum = 0;
+
+    void Merge(const RenderStats& other) {
+        primary_rays += other.primary_rays;
+        reflected_rays += other.reflected_rays;
+        refracted_rays += other.refracted_rays;
+        shadow_rays += other.shadow_rays;
+        shadowed += other.shadowed;
+        triangle_tests += other.triangle_tests;
+        sphere_tests += other.sphere_tests;
+        shaded_hits += other.shaded_hits;
+        depth_sum += other.depth_sum;
+    }
+
+    double GetAverageDepth() const {
+        return shaded_hits ? static_cast<double>(depth_sum) / shaded_hits : 0;
+    }
+
+    double GetShadowHitRate() const {
+        return shadow_rays ? static_cast<double>(shadowed) / shadow_rays : 0;
+    }
+
+    // Counters of the current thread, or nullptr if they are not collected.
+    static inline thread_local RenderStats* current = nullptr;
+};
+
+inline void Count(size_t RenderStats::*counter, size_t value = 1) {
+    if (RenderStats* stats = RenderStats::current) {
+        stats->*counter += value;
+    }
+}
+
+// Collects the counters of everything rendered on this thread into stats while it is alive.
+class RenderStatsScope {
+public:
+    explicit RenderStatsScope(RenderStats* stats) : previous_(RenderStats::current) {
+        RenderStats::current = stats;
+    }
+
+    RenderStatsScope(const RenderStatsScope&) = delete;
+    RenderStatsScope& operator=(const RenderStatsScope&) = delete;
+
+    ~RenderStatsScope() {
+        RenderStats::current = previous_;
+    }
+
+private:
+    RenderStats* previous_;
+};
+
+// Runs worker(k) for k in [0, num_threads), worker(0) on the calling thread, and merges the
+// counters of the other threads into the ones of the calling thread.
+template <class F>
+void RunWorkers(int num_threads, F&& worker) {
+    RenderStats* stats = RenderStats::current;
+    std::vector<RenderStats> worker_stats(num_threads);
+    std::vector<std::thread> threads;
+    for (int k = 1; k < num_threads; ++k) {
+        threads.emplace_back([&, k] {
+            RenderStatsScope scope(stats ? &worker_stats[k] : nullptr);
+            worker(k);
+        });
+    }
+    worker(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (stats) {
+        for (const auto& other : worker_stats) {
+            stats->Merge(other);
+        }
+    }
+}
+
+// Nearest hit of a ray. At most one of triangle and sphere is set.
+struct Hit {
+    const Object* triangle = nullptr;
+    const SphereObject* sphere = nullptr;
+    Intersection intersection;
+
+    explicit operator bool() const {
+        return triangle || sphere;
+    }
+};
+
+// Structure-of-arrays copy of the scene geometry with one contiguous array per coordinate, so
+// leaf tests stream through memory instead of chasing objects and their material pointers.
+// Triangles keep their first vertex and both edges, spheres their centre and squared radius.
+// Every primitive remembers its index in the Scene and the index of its material in materials.
+struct PackedScene {
+    PackedScene() = default;
+
+    // Packs the primitives in the given order of scene indices.
+    PackedScene(const Scene& scene, const std::vector<uint32_t>& triangle_order,
+                const std::vector<uint32_t>& sphere_order) {
+        std::unordered_map<const Material*, uint32_t> material_indices;
+        auto material_index = [&](const Material* material) {
+            auto [it, inserted] = material_indices.emplace(material, materials.size());
+            if (inserted) {
+                materials.push_back(material);
+            }
+            return it->second;
+        };
+        for (uint32_t k : triangle_order) {
+            const auto& object = scene.GetObjects()[k];
+            const auto& triangle = object.GetObject();
+            Vector edge1 = triangle.GetVertex(1) - triangle.GetVertex(0);
+            Vector edge2 = triangle.GetVertex(2) - triangle.GetVertex(0);
+            for (int a = 0; a < 3; ++a) {
+                triangles.vertex[a].push_back(triangle.GetVertex(0)[a]);
+                triangles.edge1[a].push_back(edge1[a]);
+                triangles.edge2[a].push_back(edge2[a]);
+            }
+            triangles.index.push_back(k);
+            triangles.material.push_back(material_index(object.material));
+        }
+        for (uint32_t k : sphere_order) {
+            const auto& object = scene.GetSphereObjects()[k];
+            const auto& sphere = object.GetObject();
+            for (int a = 0; a < 3; ++a) {
+                spheres.center[a].push_back(sphere.GetCenter()[a]);
+            }
+            spheres.radius2.push_back(sphere.GetRadius() * sphere.GetRadius());
+            spheres.index.push_back(k);
+            spheres.material.push_back(material_index(object.material));
+        }
+    }
+
+    // Where the exact distance of a hit that passed a prefilter can be: GetIntersection is not
+    // nearer than min and, up to the rounding the margins allow for, not farther than max.
+    struct DistanceRange {
+        double min;
+        double max;
+    };
+
+    // Conservative ray tests against the packed data: false only if the ray certainly misses
+    // the primitive or hits it farther than max_distance. The margin covers rounding
+    // differences to GetIntersection, which stays the exact test. direction must be normalized.
+    // If range is given it is set to the range of the hit distance.
+    bool MayIntersectTriangle(size_t k, const double* origin, const double* direction,
+                              double max_distance, DistanceRange* range = nullptr) const {
+        const double e1[3] = {triangles.edge1[0][k], triangles.edge1[1][k], triangles.edge1[2][k]};
+        const double e2[3] = {triangles.edge2[0][k], triangles.edge2[1][k], triangles.edge2[2][k]};
+        double h[3] = {direction[1] * e2[2] - direction[2] * e2[1],
+                       direction[2] * e2[0] - direction[0] * e2[2],
+                       direction[0] * e2[1] - direction[1] * e2[0]};
+        double det = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+        if (std::abs(det) < 1e-12) {
+            // Parallel or degenerate: leave it to the exact test, at any distance.
+            if (range) {
+                double infinity = std::numeric_limits<double>::infinity();
+                *range = {-infinity, infinity};
+            }
+            return true;
+        }
+        double inv_det = 1 / det;
+        double s[3] = {origin[0] - triangles.vertex[0][k], origin[1] - triangles.vertex[1][k],
+                       origin[2] - triangles.vertex[2][k]};
+        double u = (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]) * inv_det;
+        double q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+                       s[0] * e1[1] - s[1] * e1[0]};
+        double v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inv_det;
+        double t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+        if (range) {
+            *range = GetRange(t, kTolerance);
+        }
+        return u >= -kTolerance && v >= -kTolerance && u + v <= 1 + kTolerance &&
+               t >= -kTolerance && t <= max_distance * (1 + kTolerance) + kTolerance;
+    }
+
+    bool MayIntersectSphere(size_t k, const double* origin, const double* direction,
+                            double max_distance, DistanceRange* range = nullptr) const {
+        double oc[3] = {origin[0] - spheres.center[0][k], origin[1] - spheres.center[1][k],
+                        origin[2] - spheres.center[2][k]};
+        double b = oc[0] * direction[0] + oc[1] * direction[1] + oc[2] * direction[2];
+        double oc2 = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2];
+        double disc = b * b - (oc2 - spheres.radius2[k]);
+        if (disc < -kTolerance * (oc2 + spheres.radius2[k])) {
+            return false;
+        }
+        double root = std::sqrt(std::max(disc, 0.0));
+        double t_far = -b + root;
+        double t_near = -b - root;
+        double margin = kTolerance * (1 + std::abs(b) + root);
+        if (t_far < -margin) {
+            // The sphere is behind the ray.
+            return false;
+        }
+        double t = t_near >= -margin ? t_near : t_far;
+        if (range) {
+            *range = GetRange(t, margin);
+        }
+        return t <= max_distance * (1 + kTolerance) + margin;
+    }
+
+    struct Triangles {
+        std::vector<double> vertex[3];
+        std::vector<double> edge1[3];
+        std::vector<double> edge2[3];
+        std::vector<uint32_t> index;
+        std::vector<uint32_t> material;
+    };
+
+    struct Spheres {
+        std::vector<double> center[3];
+        std::vector<double> radius2;
+        std::vector<uint32_t> index;
+        std::vector<uint32_t> material;
+    };
+
+    Triangles triangles;
+    Spheres spheres;
+    std::vector<const Material*> materials;
+
+private:
+    static constexpr double kTolerance = 1e-6;
+
+    // The tests accept t <= max_distance * (1 + kTolerance) + margin, so a hit with t is not
+    // nearer than the smallest max_distance that accepts it.
+    static DistanceRange GetRange(double t, double margin) {
+        return {(t - margin) / (1 + kTolerance), t * (1 + kTolerance) + margin};
+    }
+};
+
+// Bounding volume hierarchy over all triangles and spheres of a scene, built with binned SAH
+// splits. Nodes are stored depth first in one array: the left child directly follows its
+// parent, leaves point at runs of triangles and spheres in a PackedScene that is laid out in
+// leaf order, so a leaf reads contiguous memory. Traversal visits the nearer child
+// first and keeps a short fixed stack. Ties between equally distant hits are broken the same
+// way as a linear scan over the scene (triangles before spheres, then by index), so the result
+// does not depend on the tree layout.
+class Bvh {
+public:
+    explicit Bvh(const Scene& scene) : scene_(&scene), geometry_hash_(HashGeometry(scene)) {
+        const auto& triangles = scene.GetObjects();
+        const auto& spheres = scene.GetSphereObjects();
+        std::vector<BuildPrimitive> primitives;
+        primitives.reserve(triangles.size() + spheres.size());
+        for (size_t k = 0; k < triangles.size(); ++k) {
+            const auto& triangle = triangles[k].GetObject();
+            Box box;
+            for (size_t v = 0; v < 3; ++v) {
+                box.Extend(triangle.GetVertex(v));
+            }
+            primitives.push_back({box, box.Center(), static_cast<uint32_t>(k)});
+        }
+        for (size_t k = 0; k < spheres.size(); ++k) {
+            const auto& sphere = spheres[k].GetObject();
+            double r = sphere.GetRadius();
+            Box box;
+            box.Extend(sphere.GetCenter() - Vector{r, r, r});
+            box.Extend(sphere.GetCenter() + Vector{r, r, r});
+            primitives.push_back({box, sphere.GetCenter(), static_cast<uint32_t>(k) | kSphereBit});
+        }
+        if (!primitives.empty()) {
+            nodes_.reserve(2 * primitives.size());
+            Build(primitives, 0, primitives.size(), 0);
+        }
+        // Build left the primitive range in every leaf; replace it by the packed runs.
+        std::vector<uint32_t> triangle_order;
+        std::vector<uint32_t> sphere_order;
+        for (auto& node : nodes_) {
+            if (node.count == 0) {
+                continue;
+            }
+            Leaf leaf{static_cast<uint32_t>(triangle_order.size()),
+                      static_cast<uint32_t>(sphere_order.size()), 0, 0};
+            for (size_t k = node.offset; k < node.offset + node.count; ++k) {
+                uint32_t ref = primitives[k].ref;
+                if (ref & kSphereBit) {
+                    sphere_order.push_back(ref & ~kSphereBit);
+                    ++leaf.sphere_count;
+                } else {
+                    triangle_order.push_back(ref);
+                    ++leaf.triangle_count;
+                }
+            }
+            node.offset = leaves_.size();
+            leaves_.push_back(leaf);
+        }
+        packed_ = PackedScene(scene, triangle_order, sphere_order);
+    }
+
+    const PackedScene& GetPackedScene() const {
+        return packed_;
+    }
+
+    // Hash of the geometry the BVH is built over: the vertices of all triangles and the
+    // centers and radii of all spheres, in scene order.
+    static uint64_t HashGeometry(const Scene& scene) {
+        uint64_t hash = 0xcbf29ce484222325;
+        auto mix = [&hash](double value) {
+            hash = (hash ^ std::bit_cast<uint64_t>(value)) * 0x100000001b3;
+        };
+        mix(scene.GetObjects().size());
+        for (const auto& object : scene.GetObjects()) {
+            for (size_t v = 0; v < 3; ++v) {
+                for (int a = 0; a < 3; ++a) {
+                    mix(object.GetObject().GetVertex(v)[a]);
+                }
+            }
+        }
+        mix(scene.GetSphereObjects().size());
+        for (const auto& object : scene.GetSphereObjects()) {
+            for (int a = 0; a < 3; ++a) {
+                mix(object.GetObject().GetCenter()[a]);
+            }
+            mix(object.GetObject().GetRadius());
+        }
+        return hash;
+    }
+
+    // Binary cache file: a header followed by the raw node, leaf and primitive order arrays, in
+    // the byte order of the machine that wrote it. Loading only validates and copies them.
+    bool Save(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary);
+        CacheHeader header{{},
+                           kCacheVersion,
+                           geometry_hash_,
+                           HashPayload(nodes_, leaves_, packed_.triangles.index,
+                                       packed_.spheres.index),
+                           nodes_.size(),
+                           leaves_.size(),
+                           packed_.triangles.index.size(),
+                           packed_.spheres.index.size()};
+        std::copy(kCacheMagic, kCacheMagic + sizeof(header.magic), header.magic);
+        Write(out, &header, 1);
+        Write(out, nodes_.data(), nodes_.size());
+        Write(out, leaves_.data(), leaves_.size());
+        Write(out, packed_.triangles.index.data(), packed_.triangles.index.size());
+        Write(out, packed_.spheres.index.data(), packed_.spheres.index.size());
+        return static_cast<bool>(out);
+    }
+
+    // The BVH saved at path if it was built over the same geometry as scene.
+    static std::optional<Bvh> Load(const std::string& path, const Scene& scene) {
+        std::ifstream in(path, std::ios::binary);
+        CacheHeader header;
+        if (!Read(in, &header, 1) ||
+            !std::equal(kCacheMagic, kCacheMagic + sizeof(header.magic), header.magic) ||
+            header.version != kCacheVersion ||
+            header.num_triangles != scene.GetObjects().size() ||
+            header.num_spheres != scene.GetSphereObjects().size() ||
+            header.geometry_hash != HashGeometry(scene)) {
+            return std::nullopt;
+        }
+        // Every leaf holds a primitive and every inner node has two children, which bounds the
+        // arrays before they are allocated. The file must hold exactly those arrays.
+        uint64_t num_primitives = header.num_triangles + header.num_spheres;
+        uint64_t size = sizeof(header) + header.num_nodes * sizeof(Node) +
+                        header.num_leaves * sizeof(Leaf) + num_primitives * sizeof(uint32_t);
+        if (header.num_nodes > 2 * num_primitives || header.num_leaves > num_primitives ||
+            !in.seekg(0, std::ios::end) || static_cast<uint64_t>(in.tellg()) != size ||
+            !in.seekg(sizeof(header))) {
+            return std::nullopt;
+        }
+        Bvh bvh;
+        bvh.scene_ = &scene;
+        bvh.geometry_hash_ = header.geometry_hash;
+        std::vector<uint32_t> triangle_order(header.num_triangles);
+        std::vector<uint32_t> sphere_order(header.num_spheres);
+        bvh.nodes_.resize(header.num_nodes);
+        bvh.leaves_.resize(header.num_leaves);
+        if (!Read(in, bvh.nodes_.data(), bvh.nodes_.size()) ||
+            !Read(in, bvh.leaves_.data(), bvh.leaves_.size()) ||
+            !Read(in, triangle_order.data(), triangle_order.size()) ||
+            !Read(in, sphere_order.data(), sphere_order.size()) ||
+            header.payload_hash !=
+                HashPayload(bvh.nodes_, bvh.leaves_, triangle_order, sphere_order) ||
+            !bvh.IsValid(triangle_order, sphere_order)) {
+            return std::nullopt;
+        }
+        bvh.packed_ = PackedScene(scene, triangle_order, sphere_order);
+        return bvh;
+    }
+
+    // Loads the BVH of scene from path, or builds it and saves it there.
+    static Bvh LoadOrBuild(const Scene& scene, const std::string& path) {
+        if (auto bvh = Load(path, scene)) {
+            return std::move(*bvh);
+        }
+        Bvh bvh(scene);
+        bvh.Save(path);
+        return bvh;
+    }
+
+    // The traversal only runs the packed prefilters and keeps the primitives that pass as
+    // candidates. GetIntersection runs once the traversal is done, on the candidates that can
+    // still be the nearest, see ResolveCandidates.
+    Hit FindNearestIntersection(const Ray& ray) const {
+        if (nodes_.empty()) {
+            return Hit();
+        }
+        RayData data(ray);
+        Candidates candidates;
+        uint32_t stack[kMaxTreeDepth + 1];
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            const Node& node = nodes_[stack[--size]];
+            double t_near;
+            if (!node.Intersects(data, candidates.bound, &t_near)) {
+                continue;
+            }
+            if (node.count > 0) {
+                CollectLeaf(data, leaves_[node.offset], &candidates);
+                continue;
+            }
+            uint32_t left = &node - nodes_.data() + 1;
+            uint32_t right = node.offset;
+            // Push the farther child first so that the nearer one is visited next.
+            if (data.direction[node.axis] < 0) {
+                std::swap(left, right);
+            }
+            stack[size++] = right;
+            stack[size++] = left;
+        }
+        if (auto hit = ResolveCandidates(ray, candidates)) {
+            return *hit;
+        }
+        return FindNearestIntersectionExact(ray);
+    }
+
+    // Any-hit query for shadow rays: true if something is hit closer than max_distance. Returns
+    // on the first such primitive, in whatever order the nodes come.
+    bool IsOccluded(const Ray& ray, double max_distance) const {
+        if (nodes_.empty()) {
+            return false;
+        }
+        RayData data(ray);
+        uint32_t stack[kMaxTreeDepth + 1];
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            const Node& node = nodes_[stack[--size]];
+            double t_near;
+            if (!node.Intersects(data, max_distance, &t_near)) {
+                continue;
+            }
+            if (node.count > 0) {
+                const Leaf& leaf = leaves_[node.offset];
+                const auto& objects = scene_->GetObjects();
+                const auto& spheres = scene_->GetSphereObjects();
+                uint32_t triangle_end = leaf.triangle_begin + leaf.triangle_count;
+                for (uint32_t k = leaf.triangle_begin; k < triangle_end; ++k) {
+                    if (packed_.MayIntersectTriangle(k, data.origin, data.direction,
+                                                     max_distance)) {
+                        Count(&RenderStats::triangle_tests);
+                        auto intersection =
+                            GetIntersection(ray, objects[packed_.triangles.index[k]].GetObject());
+                        if (intersection && intersection->GetDistance() < max_distance) {
+                            return true;
+                        }
+                    }
+                }
+                for (uint32_t k = leaf.sphere_begin; k < leaf.sphere_begin + leaf.sphere_count;
+                     ++k) {
+                    if (packed_.MayIntersectSphere(k, data.origin, data.direction,
+                                                   max_distance)) {
+                        Count(&RenderStats::sphere_tests);
+                        auto intersection =
+                            GetIntersection(ray, spheres[packed_.spheres.index[k]].GetObject());
+                        if (intersection && intersection->GetDistance() < max_distance) {
+                            return true;
+                        }
+                    }
+                }
+                continue;
+            }
+            stack[size++] = node.offset;
+            stack[size++] = &node - nodes_.data() + 1;
+        }
+        return false;
+    }
+
+    // Nearest hits of up to kPacketSize rays traced together. The rays share one traversal: a
+    // node is entered while any ray of the packet still overlaps it, and its box is tested
+    // against all rays at once. Leaves test only the rays that reached them, with the same
+    // intersection routines and tie-breaking as the single-ray query, so hits[k] is exactly
+    // FindNearestIntersection(rays[k]).
+    void FindNearestIntersections(const Ray* rays, int count, Hit* hits) const {
+        assert(count > 0 && count <= kPacketSize);
+        for (int lane = 0; lane < count; ++lane) {
+            hits[lane] = Hit();
+        }
+        if (nodes_.empty()) {
+            return;
+        }
+        RayPacket packet(rays, count);
+        Candidates candidates[kPacketSize];
+        // Bound of the hit distance of every lane; unused lanes never enter a node.
+        double t_max[kPacketSize];
+        for (int lane = 0; lane < kPacketSize; ++lane) {
+            t_max[lane] = lane < count ? kInfinity : -kInfinity;
+        }
+        uint32_t stack[kMaxTreeDepth + 1];
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            const Node& node = nodes_[stack[--size]];
+            bool active[kPacketSize];
+            if (!node.Intersects(packet, t_max, active)) {
+                continue;
+            }
+            if (node.count > 0) {
+                for (int lane = 0; lane < count; ++lane) {
+                    if (!active[lane]) {
+                        continue;
+                    }
+                    CollectLeaf(packet.lanes[lane], leaves_[node.offset], &candidates[lane]);
+                    t_max[lane] = candidates[lane].bound;
+                }
+                continue;
+            }
+            uint32_t left = &node - nodes_.data() + 1;
+            uint32_t right = node.offset;
+            // Primary rays of one packet are coherent, so the first ray decides the order.
+            if (packet.direction[node.axis][0] < 0) {
+                std::swap(left, right);
+            }
+            stack[size++] = right;
+            stack[size++] = left;
+        }
+        for (int lane = 0; lane < count; ++lane) {
+            if (auto hit = ResolveCandidates(rays[lane], candidates[lane])) {
+                hits[lane] = *hit;
+            } else {
+                hits[lane] = FindNearestIntersectionExact(rays[lane]);
+            }
+        }
+    }
+
+    static constexpr int kPacketSize = 4;
+
+private:
+    static constexpr char kCacheMagic[8] = {'R', 'T', 'B', 'V', 'H', 0, 0, 0};
+    static constexpr uint32_t kCacheVersion = 1;
+
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint64_t geometry_hash;
+        // Of the arrays that follow the header.
+        uint64_t payload_hash;
+        uint64_t num_nodes;
+        uint64_t num_leaves;
+        uint64_t num_triangles;
+        uint64_t num_spheres;
+    };
+
+    Bvh() = default;
+
+    template <class... Arrays>
+    static uint64_t HashPayload(const Arrays&... arrays) {
+        uint64_t hash = 0xcbf29ce484222325;
+        auto mix = [&hash](const auto& array) {
+            const auto* bytes = reinterpret_cast<const unsigned char*>(array.data());
+            for (size_t k = 0; k < array.size() * sizeof(array[0]); ++k) {
+                hash = (hash ^ bytes[k]) * 0x100000001b3;
+            }
+        };
+        (mix(arrays), ...);
+        return hash;
+    }
+
+    template <class T>
+    static void Write(std::ofstream& out, const T* data, size_t size) {
+        out.write(reinterpret_cast<const char*>(data), size * sizeof(T));
+    }
+
+    template <class T>
+    static bool Read(std::ifstream& in, T* data, size_t size) {
+        in.read(reinterpret_cast<char*>(data), size * sizeof(T));
+        return static_cast<bool>(in);
+    }
+
+    // Checks that a loaded tree only refers to existing nodes and primitives, that it fits the
+    // traversal stack, and that every primitive is in exactly one leaf.
+    bool IsValid(const std::vector<uint32_t>& triangle_order,
+                 const std::vector<uint32_t>& sphere_order) const {
+        size_t triangles = 0;
+        size_t spheres = 0;
+        // Children follow their parents, so one forward pass finds every depth.
+        std::vector<int> depths(nodes_.size());
+        for (size_t k = 0; k < nodes_.size(); ++k) {
+            const Node& node = nodes_[k];
+            if (node.count == 0) {
+                if (k + 1 >= nodes_.size() || node.offset <= k + 1 ||
+                    node.offset >= nodes_.size() || node.axis > 2 ||
+                    depths[k] >= kMaxTreeDepth) {
+                    return false;
+                }
+                depths[k + 1] = std::max(depths[k + 1], depths[k] + 1);
+                depths[node.offset] = std::max(depths[node.offset], depths[k] + 1);
+                continue;
+            }
+            if (node.offset >= leaves_.size()) {
+                return false;
+            }
+            const Leaf& leaf = leaves_[node.offset];
+            if (leaf.triangle_begin + leaf.triangle_count > triangle_order.size() ||
+                leaf.sphere_begin + leaf.sphere_count > sphere_order.size() ||
+                leaf.triangle_count + leaf.sphere_count != node.count) {
+                return false;
+            }
+            triangles += leaf.triangle_count;
+            spheres += leaf.sphere_count;
+        }
+        if (triangles != triangle_order.size() || spheres != sphere_order.size()) {
+            return false;
+        }
+        std::vector<bool> seen(triangle_order.size() + sphere_order.size());
+        for (uint32_t index : triangle_order) {
+            if (index >= triangle_order.size() || seen[index]) {
+                return false;
+            }
+            seen[index] = true;
+        }
+        for (uint32_t index : sphere_order) {
+            if (index >= sphere_order.size() || seen[triangle_order.size() + index]) {
+                return false;
+            }
+            seen[triangle_order.size() + index] = true;
+        }
+        return true;
+    }
+
+    static constexpr uint32_t kSphereBit = 1u << 31;
+    // SAH splits stop at kMaxDepth; below it ranges are halved, and primitive refs have 31 bits.
+    static constexpr int kMaxDepth = 48;
+    static constexpr int kMaxMedianDepth = 31;
+    static constexpr int kMaxTreeDepth = kMaxDepth + kMaxMedianDepth;
+    static constexpr int kMaxLeafSize = 4;
+    static constexpr int kBins = 16;
+    static constexpr double kInfinity = std::numeric_limits<double>::infinity();
+
+    struct Box {
+        double min[3] = {kInfinity, kInfinity, kInfinity};
+        double max[3] = {-kInfinity, -kInfinity, -kInfinity};
+
+        void Extend(const Vector& point) {
+            for (int a = 0; a < 3; ++a) {
+                min[a] = std::min(min[a], point[a]);
+                max[a] = std::max(max[a], point[a]);
+            }
+        }
+
+        void Extend(const Box& box) {
+            for (int a = 0; a < 3; ++a) {
+                min[a] = std::min(min[a], box.min[a]);
+                max[a] = std::max(max[a], box.max[a]);
+            }
+        }
+
+        Vector Center() const {
+            return {(min[0] + max[0]) / 2, (min[1] + max[1]) / 2, (min[2] + max[2]) / 2};
+        }
+
+        double HalfArea() const {
+            if (min[0] > max[0]) {
+                return 0;
+            }
+            double dx = max[0] - min[0];
+            double dy = max[1] - min[1];
+            double dz = max[2] - min[2];
+            return dx * dy + dy * dz + dz * dx;
+        }
+    };
+
+    struct BuildPrimitive {
+        Box box;
+        Vector centroid;
+        uint32_t ref;
+    };
+
+    // The direction is normalized so that slab distances compare with hit distances.
+    struct RayData {
+        explicit RayData(const Ray& ray) {
+            double length = Length(ray.GetDirection());
+            for (int a = 0; a < 3; ++a) {
+                origin[a] = ray.GetOrigin()[a];
+                direction[a] = ray.GetDirection()[a] / length;
+                inv_direction[a] = 1.0 / direction[a];
+            }
+        }
+
+        double origin[3];
+        double direction[3];
+        double inv_direction[3];
+    };
+
+    // RayData of a whole packet, one array per coordinate. Unused lanes repeat the last ray.
+    struct RayPacket {
+        RayPacket(const Ray* rays, int count)
+            : lanes{RayData(rays[0]), RayData(rays[std::min(1, count - 1)]),
+                    RayData(rays[std::min(2, count - 1)]), RayData(rays[std::min(3, count - 1)])} {
+            static_assert(kPacketSize == 4);
+            for (int lane = 0; lane < kPacketSize; ++lane) {
+                for (int a = 0; a < 3; ++a) {
+                    origin[a][lane] = lanes[lane].origin[a];
+                    direction[a][lane] = lanes[lane].direction[a];
+                    inv_direction[a][lane] = lanes[lane].inv_direction[a];
+                }
+            }
+        }
+
+        RayData lanes[kPacketSize];
+        double origin[3][kPacketSize];
+        double direction[3][kPacketSize];
+        double inv_direction[3][kPacketSize];
+    };
+
+    // Runs of a leaf in the packed triangle and sphere arrays.
+    struct Leaf {
+        uint32_t triangle_begin;
+        uint32_t sphere_begin;
+        uint16_t triangle_count;
+        uint16_t sphere_count;
+    };
+
+    // 32 bytes. Bounds are stored as floats rounded outwards, so they stay conservative.
+    struct Node {
+        float min[3];
+        float max[3];
+        // Leaf: index in leaves_. Inner node: index of the right child.
+        uint32_t offset;
+        uint16_t count;
+        uint16_t axis;
+
+        bool Intersects(const RayData& ray, double t_max, double* t_near) const {
+            double t_min = 0;
+            for (int a = 0; a < 3; ++a) {
+                if (ray.direction[a] == 0) {
+                    if (ray.origin[a] < min[a] || ray.origin[a] > max[a]) {
+                        return false;
+                    }
+                    continue;
+                }
+                double t0 = (min[a] - ray.origin[a]) * ray.inv_direction[a];
+                double t1 = (max[a] - ray.origin[a]) * ray.inv_direction[a];
+                if (t0 > t1) {
+                    std::swap(t0, t1);
+                }
+                t_min = std::max(t_min, t0);
+                t_max = std::min(t_max, t1);
+                if (t_min > t_max) {
+                    return false;
+                }
+            }
+            *t_near = t_min;
+            return true;
+        }
+
+        // The slab test of every lane of a packet. The loops have no branches, so the compiler
+        // turns them into vector code. Returns whether any lane hit.
+        //
+        // A zero direction component gives infinite slab distances, or NaN when the origin lies
+        // on the slab plane. std::min and std::max return their first argument for NaN, so the
+        // argument order below ignores such a slab, which is what the single-ray test does.
+        bool Intersects(const RayPacket& packet, const double* t_max, bool* active) const {
+            double t_min[kPacketSize];
+            double t_far[kPacketSize];
+            for (int lane = 0; lane < kPacketSize; ++lane) {
+                t_min[lane] = 0;
+                t_far[lane] = t_max[lane];
+            }
+            for (int a = 0; a < 3; ++a) {
+                for (int lane = 0; lane < kPacketSize; ++lane) {
+                    double origin = packet.origin[a][lane];
+                    double t0 = (min[a] - origin) * packet.inv_direction[a][lane];
+                    double t1 = (max[a] - origin) * packet.inv_direction[a][lane];
+                    t_min[lane] = std::max(t_min[lane], std::min(t0, t1));
+                    t_far[lane] = std::min(t_far[lane], std::max(t0, t1));
+                }
+            }
+            bool any = false;
+            for (int lane = 0; lane < kPacketSize; ++lane) {
+                active[lane] = t_min[lane] <= t_far[lane];
+                any |= active[lane];
+            }
+            return any;
+        }
+    };
+
+    uint32_t Build(std::vector<BuildPrimitive>& primitives, size_t begin, size_t end, int depth) {
+        uint32_t index = nodes_.size();
+        nodes_.emplace_back();
+        Box bounds;
+        Box centroids;
+        for (size_t k = begin; k < end; ++k) {
+            bounds.Extend(primitives[k].box);
+            centroids.Extend(primitives[k].centroid);
+        }
+        for (int a = 0; a < 3; ++a) {
+            nodes_[index].min[a] = std::nextafter(static_cast<float>(bounds.min[a]), -HUGE_VALF);
+            nodes_[index].max[a] = std::nextafter(static_cast<float>(bounds.max[a]), HUGE_VALF);
+        }
+
+        size_t count = end - begin;
+        size_t mid = begin;
+        int axis = 0;
+        if (count > 1 && depth < kMaxDepth) {
+            mid = FindSahSplit(primitives, begin, end, bounds, centroids, &axis);
+        }
+        if (mid == begin || mid == end) {
+            if (count <= kMaxLeafSize) {
+                nodes_[index].offset = begin;
+                nodes_[index].count = count;
+                return index;
+            }
+            // SAH found nothing better than a leaf but the leaf would be too large, or the SAH
+            // depth is used up. Median splits end in leaves within kMaxMedianDepth more levels.
+            axis = LongestAxis(centroids);
+            mid = begin + count / 2;
+            std::nth_element(primitives.begin() + begin, primitives.begin() + mid,
+                             primitives.begin() + end, [axis](const auto& lhs, const auto& rhs) {
+                                 return lhs.centroid[axis] < rhs.centroid[axis];
+                             });
+        }
+        nodes_[index].axis = axis;
+        nodes_[index].count = 0;
+        Build(primitives, begin, mid, depth + 1);
+        uint32_t right = Build(primitives, mid, end, depth + 1);
+        nodes_[index].offset = right;
+        return index;
+    }
+
+    static int LongestAxis(const Box& box) {
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) {
+            if (box.max[a] - box.min[a] > box.max[axis] - box.min[axis]) {
+                axis = a;
+            }
+        }
+        return axis;
+    }
+
+    // Returns the partition point of the cheapest binned SAH split, or begin if a leaf is
+    // cheaper.
+    static size_t FindSahSplit(std::vector<BuildPrimitive>& primitives, size_t begin, size_t end,
+                               const Box& bounds, const Box& centroids, int* best_axis) {
+        double best_cost = (end - begin) * bounds.HalfArea();
+        int best_bin = -1;
+        for (int a = 0; a < 3; ++a) {
+            double extent = centroids.max[a] - centroids.min[a];
+            if (extent <= 0) {
+                continue;
+            }
+            Box bin_boxes[kBins];
+            size_t bin_counts[kBins] = {};
+            for (size_t k = begin; k < end; ++k) {
+                int bin = GetBin(primitives[k].centroid[a], centroids.min[a], extent);
+                bin_boxes[bin].Extend(primitives[k].box);
+                ++bin_counts[bin];
+            }
+            // Sweep from the right to get the cost of every "bins (b, kBins)" suffix.
+            double right_costs[kBins] = {};
+            Box right_box;
+            size_t right_count = 0;
+            for (int b = kBins - 1; b > 0; --b) {
+                right_box.Extend(bin_boxes[b]);
+                right_count += bin_counts[b];
+                right_costs[b] = right_count * right_box.HalfArea();
+            }
+            Box left_box;
+            size_t left_count = 0;
+            for (int b = 0; b + 1 < kBins; ++b) {
+                left_box.Extend(bin_boxes[b]);
+                left_count += bin_counts[b];
+                double cost = kTraversalCost * bounds.HalfArea() +
+                              left_count * left_box.HalfArea() + right_costs[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_bin = b;
+                    *best_axis = a;
+                }
+            }
+        }
+        if (best_bin < 0) {
+            return begin;
+        }
+        int axis = *best_axis;
+        double extent = centroids.max[axis] - centroids.min[axis];
+        auto it = std::partition(primitives.begin() + begin, primitives.begin() + end,
+                                 [&](const auto& primitive) {
+                                     return GetBin(primitive.centroid[axis],
+                                                   centroids.min[axis], extent) <= best_bin;
+                                 });
+        return it - primitives.begin();
+    }
+
+    static int GetBin(double value, double min, double extent) {
+        int bin = static_cast<int>(kBins * (value - min) / extent);
+        return std::clamp(bin, 0, kBins - 1);
+    }
+
+    // Relative cost of visiting an inner node, in units of one primitive test.
+    static constexpr double kTraversalCost = 1.0;
+
+    // Nearest hit with the exact test in every leaf, for the queries that the candidates could
+    // not decide.
+    Hit FindNearestIntersectionExact(const Ray& ray) const {
+        Hit hit;
+        uint32_t best_ref = 0;
+        if (nodes_.empty()) {
+            return hit;
+        }
+        RayData data(ray);
+        uint32_t stack[kMaxTreeDepth + 1];
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            const Node& node = nodes_[stack[--size]];
+            double t_near;
+            if (!node.Intersects(data, hit ? hit.intersection.GetDistance() : kInfinity, &t_near)) {
+                continue;
+            }
+            if (node.count > 0) {
+                TestLeaf(ray, data, leaves_[node.offset], &hit, &best_ref);
+                continue;
+            }
+            uint32_t left = &node - nodes_.data() + 1;
+            uint32_t right = node.offset;
+            // Push the farther child first so that the nearer one is visited next.
+            if (data.direction[node.axis] < 0) {
+                std::swap(left, right);
+            }
+            stack[size++] = right;
+            stack[size++] = left;
+        }
+        return hit;
+    }
+
+    // Primitives of a nearest hit query that passed the prefilter, with the smallest distance
+    // their exact hit can have. bound is the smallest maximum: unless rounding is worse than the
+    // prefilter margins allow for, the nearest hit is not farther than that.
+    struct Candidates {
+        static constexpr int kCapacity = 8;
+
+        // Packed index, with kSphereBit for spheres.
+        uint32_t refs[kCapacity];
+        double min_distances[kCapacity];
+        int size = 0;
+        // Set if candidates were lost, which leaves the query to the exact traversal.
+        bool overflow = false;
+        double bound = kInfinity;
+
+        void Add(uint32_t ref, const PackedScene::DistanceRange& range) {
+            if (size == kCapacity) {
+                // Drop the candidates that are certainly farther than the bound.
+                int kept = 0;
+                for (int k = 0; k < size; ++k) {
+                    if (min_distances[k] <= bound) {
+                        refs[kept] = refs[k];
+                        min_distances[kept++] = min_distances[k];
+                    }
+                }
+                size = kept;
+                if (size == kCapacity) {
+                    overflow = true;
+                    return;
+                }
+            }
+            refs[size] = ref;
+            min_distances[size++] = range.min;
+            bound = std::min(bound, range.max);
+        }
+    };
+
+    void CollectLeaf(const RayData& data, const Leaf& leaf, Candidates* candidates) const {
+        PackedScene::DistanceRange range;
+        for (uint32_t k = leaf.triangle_begin; k < leaf.triangle_begin + leaf.triangle_count; ++k) {
+            if (packed_.MayIntersectTriangle(k, data.origin, data.direction, candidates->bound,
+                                             &range)) {
+                candidates->Add(k, range);
+            }
+        }
+        for (uint32_t k = leaf.sphere_begin; k < leaf.sphere_begin + leaf.sphere_count; ++k) {
+            if (packed_.MayIntersectSphere(k, data.origin, data.direction, candidates->bound,
+                                           &range)) {
+                candidates->Add(k | kSphereBit, range);
+            }
+        }
+    }
+
+    // Runs the exact tests of the candidates that can be nearer than the bound. Every primitive
+    // that was culled, rejected by the prefilter or dropped is farther than the bound, so if the
+    // nearest exact hit is within it, it is the hit of the exact traversal. Returns nullopt if it
+    // is not, or if candidates were lost.
+    std::optional<Hit> ResolveCandidates(const Ray& ray, const Candidates& candidates) const {
+        if (candidates.overflow) {
+            return std::nullopt;
+        }
+        const auto& objects = scene_->GetObjects();
+        const auto& spheres = scene_->GetSphereObjects();
+        Hit hit;
+        uint32_t best_ref = 0;
+        for (int k = 0; k < candidates.size; ++k) {
+            if (candidates.min_distances[k] > candidates.bound) {
+                continue;
+            }
+            uint32_t ref = candidates.refs[k];
+            if (ref & kSphereBit) {
+                Count(&RenderStats::sphere_tests);
+                uint32_t index = packed_.spheres.index[ref & ~kSphereBit];
+                if (TestPrimitive(GetIntersection(ray, spheres[index].GetObject()),
+                                  index | kSphereBit, &hit, &best_ref)) {
+                    hit.sphere = &spheres[index];
+                    hit.triangle = nullptr;
+                }
+            } else {
+                Count(&RenderStats::triangle_tests);
+                uint32_t index = packed_.triangles.index[ref];
+                if (TestPrimitive(GetIntersection(ray, objects[index].GetObject()), index, &hit,
+                                  &best_ref)) {
+                    hit.triangle = &objects[index];
+                    hit.sphere = nullptr;
+                }
+            }
+        }
+        if (candidates.size > 0 && (!hit || hit.intersection.GetDistance() > candidates.bound)) {
+            return std::nullopt;
+        }
+        return hit;
+    }
+
+    void TestLeaf(const Ray& ray, const RayData& data, const Leaf& leaf, Hit* hit,
+                  uint32_t* best_ref) const {
+        const auto& objects = scene_->GetObjects();
+        const auto& spheres = scene_->GetSphereObjects();
+        for (uint32_t k = leaf.triangle_begin; k < leaf.triangle_begin + leaf.triangle_count; ++k) {
+            double best = *hit ? hit->intersection.GetDistance() : kInfinity;
+            if (packed_.MayIntersectTriangle(k, data.origin, data.direction, best)) {
+                Count(&RenderStats::triangle_tests);
+                uint32_t index = packed_.triangles.index[k];
+                if (TestPrimitive(GetIntersection(ray, objects[index].GetObject()), index, hit,
+                                  best_ref)) {
+                    hit->triangle = &objects[index];
+                    hit->sphere = nullptr;
+                }
+            }
+        }
+        for (uint32_t k = leaf.sphere_begin; k < leaf.sphere_begin + leaf.sphere_count; ++k) {
+            double best = *hit ? hit->intersection.GetDistance() : kInfinity;
+            if (packed_.MayIntersectSphere(k, data.origin, data.direction, best)) {
+                Count(&RenderStats::sphere_tests);
+                uint32_t index = packed_.spheres.index[k];
+                if (TestPrimitive(GetIntersection(ray, spheres[index].GetObject()),
+                                  index | kSphereBit, hit, best_ref)) {
+                    hit->sphere = &spheres[index];
+                    hit->triangle = nullptr;
+                }
+            }
+        }
+    }
+
+    // Makes intersection the current hit if it is nearer. The caller sets the object.
+    static bool TestPrimitive(const std::optional<Intersection>& intersection, uint32_t ref,
+                              Hit* hit, uint32_t* best_ref) {
+        if (!intersection) {
+            return false;
+        }
+        if (*hit) {
+            double best = hit->intersection.GetDistance();
+            double distance = intersection->GetDistance();
+            // Triangle refs are smaller than sphere refs, so this prefers triangles on ties.
+            if (distance > best || (distance == best && ref > *best_ref)) {
+                return false;
+            }
+        }
+        hit->intersection = *intersection;
+        *best_ref = ref;
+        return true;
+    }
+
+    const Scene* scene_ = nullptr;
+    uint64_t geometry_hash_ = 0;
+    std::vector<Node> nodes_;
+    std::vector<Leaf> leaves_;
+    PackedScene packed_;
+};
+
+// Pruning of secondary rays in kFull mode.
+struct PathOptions {
+    // Reflected and refracted rays whose weight, the product of the albedos along their path,
+    // is below min_weight are not traced. 0 traces every ray up to RenderOptions::depth.
+    double min_weight = 0;
+    // Trace such rays with probability weight / min_weight instead and scale their color up to
+    // compensate (Russian roulette). The decision is a hash of the ray, so images are
+    // reproducible.
+    bool russian_roulette = false;
+};
+
+// Shadow rays of the lights in kFull mode.
+struct LightOptions {
+    // Lights whose unshadowed contribution to a hit, the largest channel of what they would add
+    // to its color, is below min_contribution are skipped without a shadow ray. Lights that add
+    // nothing, such as the ones behind the surface, are always skipped.
+    double min_contribution = 0;
+    // If positive and the scene has more lights, every hit traces only this many shadow rays,
+    // to lights picked with probability proportional to their contribution, and scales their
+    // light to compensate. The picks are a hash of the view ray, so images are reproducible.
+    int samples = 0;
+};
+
+// What a ray needs besides its own state: the scene and its acceleration structure.
+struct TraceContext {
+    const Scene& scene;
+    const Bvh& bvh;
+    PathOptions path = {};
+    // Replaces the lights of the scene when set.
+    const std::vector<Light>* lights = nullptr;
+    LightOptions light = {};
+
+    const std::vector<Light>& GetLights() const {
+        return lights ? *lights : scene.GetLights();
+    }
+
+    bool SamplesLights() const {
+        return light.samples > 0 && GetLights().size() > static_cast<size_t>(light.samples);
+    }
+};
+
+// light_ray starts at the light and points at pos, light_distance is the distance between them.
+// Anything hit before pos (with the same 1e-6 tolerance as before) casts the shadow.
+inline bool IsInShadow(const TraceContext& context, const Ray& light_ray, double light_distance) {
+    bool shadowed = context.bvh.IsOccluded(light_ray, light_distance - 1e-6);
+    Count(&RenderStats::shadow_rays);
+    Count(&RenderStats::shadowed, shadowed);
+    return shadowed;
+}
+
+// Uniform number in [0, 1) that depends only on the ray and salt.
+inline double HashRay(const Ray& ray, uint64_t salt = 0) {
+    uint64_t hash = 0x9e3779b97f4a7c15 ^ salt;
+    auto mix = [&hash](double value) {
+        hash ^= std::bit_cast<uint64_t>(value);
+        hash *= 0xff51afd7ed558ccd;
+        hash ^= hash >> 33;
+    };
+    for (int a = 0; a < 3; ++a) {
+        mix(ray.GetOrigin()[a]);
+        mix(ray.GetDirection()[a]);
+    }
+    return (hash >> 11) * 0x1.0p-53;
+}
+
+// What a kFull mode hit contributes: the local color and the secondary rays. The color of the hit
+// is local + reflection * reflected + refracted * refraction, where reflected and refracted are
+// the colors seen along the secondary rays, or zero for the rays that are not traced.
+struct Bounce {
+    Vector local;
+    std::optional<Ray> reflected;
+    std::optional<Ray> refracted;
+    double reflection = 0;
+    double refraction = 1;
+};
+
+// Diffuse and specular light that one light adds to a hit if nothing is in between.
+struct LightTerm {
+    Vector diffusion;
+    Vector specular;
+};
 
 template <class T>
-auto FindNearestIntersection(const std::vector<T>& objects, const Ray& ray,
-                             Intersection& best_intersection, bool flag) {
-    const T* target_object = nullptr;
-    for (auto& obj : objects) {
-        auto intersection = GetIntersection(ray, obj.GetObject());
-        if (intersection && ((!flag && !target_object) ||
-                             intersection->GetDistance() < best_intersection.GetDistance())) {
-            best_intersection = intersection.value();
-            target_object = &obj;
+LightTerm GetLightTerm(const Ray& view_ray, const Intersection& vis_intersection, const T& vis_obj,
+                       const Light& light, const Ray& light_ray) {
+    double l_d = std::max(0.0, DotProduct(-light_ray.GetDirection(), vis_intersection.GetNormal()));
+    double l_s = std::pow(std::max(0.0, DotProduct(-view_ray.GetDirection(),
+                                                   Reflect(light_ray.GetDirection(),
+                                                           vis_intersection.GetNormal()))),
+                          vis_obj.material->specular_exponent);
+    return {l_d * light.intensity * vis_obj.material->diffuse_color,
+            l_s * light.intensity * vis_obj.material->specular_color};
+}
+
+// The largest channel that term adds to the color of a hit with material. Zero if it adds
+// nothing, in which case leaving it out does not change the color.
+inline double GetLightWeight(const LightTerm& term, const Material& material) {
+    double weight = 0;
+    for (int a = 0; a < 3; ++a) {
+        weight = std::max(weight, term.diffusion[a] + term.specular[a]);
+    }
+    return material.albedo[0] * weight;
+}
+
+inline double GetLightWeight(const Ray& view_ray, const Hit& hit, const Light& light,
+                             const Ray& light_ray) {
+    if (hit.sphere != nullptr) {
+        auto term = GetLightTerm(view_ray, hit.intersection, *hit.sphere, light, light_ray);
+        return GetLightWeight(term, *hit.sphere->material);
+    }
+    auto term = GetLightTerm(view_ray, hit.intersection, *hit.triangle, light, light_ray);
+    return GetLightWeight(term, *hit.triangle->material);
+}
+
+inline bool IsLightSkipped(const TraceContext& context, double weight) {
+    return weight == 0 || weight < context.light.min_contribution;
+}
+
+// The ray from light to position and its length.
+inline Ray GetLightRay(const Light& light, const Vector& position, double* light_distance) {
+    auto light_vector = position - light.position;
+    *light_distance = Length(light_vector);
+    light_vector.Normalize();
+    return Ray(light.position, light_vector);
+}
+
+// in_shadow(light_index, light_ray, light_distance) tells whether the hit is in the shadow of a
+// light, so the shadow rays can also be traced in advance. It is only asked for the lights
+// that are not skipped, see LightOptions.
+template <class T, class ShadowTest>
+Bounce GetBounce(const TraceContext& context, const Ray& view_ray,
+                 const Intersection& vis_intersection, const T& vis_obj, ShadowTest&& in_shadow) {
+    Bounce bounce;
+    Vector general, diffusion, specular;
+    general = vis_obj.material->intensity + vis_obj.material->ambient_color;
+    // Specular and diffusion
+    const auto& lights = context.GetLights();
+    if (context.SamplesLights()) {
+        // Cumulative weights of the lights, so a uniform number in [0, total) picks a light
+        // with probability proportional to its weight.
+        thread_local std::vector<double> cumulative;
+        cumulative.clear();
+        double total = 0;
+        for (const auto& light : lights) {
+            double light_distance;
+            Ray light_ray = GetLightRay(light, vis_intersection.GetPosition(), &light_distance);
+            auto term = GetLightTerm(view_ray, vis_intersection, vis_obj, light, light_ray);
+            double weight = GetLightWeight(term, *vis_obj.material);
+            total += IsLightSkipped(context, weight) ? 0 : weight;
+            cumulative.push_back(total);
+        }
+        for (int sample = 0; total > 0 && sample < context.light.samples; ++sample) {
+            double u = HashRay(view_ray, sample + 1) * total;
+            size_t light_index =
+                std::upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+            light_index = std::min(light_index, lights.size() - 1);
+            const auto& light = lights[light_index];
+            double light_distance;
+            Ray light_ray = GetLightRay(light, vis_intersection.GetPosition(), &light_distance);
+            if (in_shadow(light_index, light_ray, light_distance)) {
+                continue;
+            }
+            auto term = GetLightTerm(view_ray, vis_intersection, vis_obj, light, light_ray);
+            double scale =
+                total / (context.light.samples * GetLightWeight(term, *vis_obj.material));
+            diffusion = diffusion + scale * term.diffusion;
+            specular = specular + scale * term.specular;
+        }
+    } else {
+        for (size_t light_index = 0; light_index < lights.size(); ++light_index) {
+            const auto& light = lights[light_index];
+            double light_distance;
+            Ray light_ray = GetLightRay(light, vis_intersection.GetPosition(), &light_distance);
+            auto term = GetLightTerm(view_ray, vis_intersection, vis_obj, light, light_ray);
+            // Skipped lights need no shadow ray
+            if (IsLightSkipped(context, GetLightWeight(term, *vis_obj.material)) ||
+                in_shadow(light_index, light_ray, light_distance)) {
+                continue;
+            }
+            diffusion = diffusion + term.diffusion;
+            specular = specular + term.specular;
+        }
+    }
+    bounce.local = general + vis_obj.material->albedo[0] * (diffusion + specular);
+    // Refraction
+    bool inside = vis_obj.IsInside(view_ray.GetDirection(), vis_intersection.GetNormal());
+    if (vis_obj.material->albedo[2] > 0) {
+        double eta = 1.0 / vis_obj.material->refraction_index;
+        auto refracted_ray = Refract(view_ray.GetDirection(), vis_intersection.GetNormal(), eta);
+        if (refracted_ray) {
+            refracted_ray->Normalize();
+            Vector origin = vis_intersection.GetPosition() + 1e-5 * refracted_ray.value();
+            bounce.refracted.emplace(origin, refracted_ray.value());
+            if (!inside) {
+                bounce.refraction = vis_obj.material->albedo[2];
+            }
         }
     }
-    return target_object;
+    // Reflection
+    bounce.reflection = vis_obj.material->albedo[1];
+    if (vis_obj.material->albedo[1] > 0 && !inside) {
+        Vector origin = vis_intersection.GetPosition() + 1e-5 * vis_intersection.GetNormal();
+        Vector reflected_ray = Reflect(view_ray.GetDirection(), vis_intersection.GetNormal());
+        reflected_ray.Normalize();
+        bounce.reflected.emplace(origin, reflected_ray);
+    }
+    return bounce;
+}
+
+template <class ShadowTest>
+Bounce GetBounce(const TraceContext& context, const Ray& view_ray, Hit& hit,
+                 ShadowTest&& in_shadow) {
+    if (hit.sphere != nullptr) {
+        return GetBounce(context, view_ray, hit.intersection, *hit.sphere, in_shadow);
+    }
+    return GetBounce(context, view_ray, hit.intersection, *hit.triangle, in_shadow);
 }
 
-inline bool IsInShadow(const Scene& scene, const Light& light, const Vector& pos) {
-    auto light_vector = pos - light.position;
-    light_vector.Normalize();
-    Ray light_ray(light.position, light_vector);
-    // find intersection
-    Intersection best_intersection;
-    bool triangle_f = false;
-    auto triangle =
-        FindNearestIntersection(scene.GetObjects(), light_ray, best_intersection, triangle_f);
-    triangle_f = triangle != nullptr;
-    FindNearestIntersection(scene.GetSphereObjects(), light_ray, best_intersection, triangle_f);
-    return (Length(pos - best_intersection.GetPosition()) > 1e-6);
+inline Bounce GetBounce(const TraceContext& context, const Ray& view_ray, Hit& hit) {
+    return GetBounce(context, view_ray, hit,
+                     [&context](size_t, const Ray& light_ray, double light_distance) {
+                         return IsInShadow(context, light_ray, light_distance);
+                     });
 }
 
-template <class T>
-void GetColor(const Scene& scene, const Ray& view_ray, RenderOptions opt,
-              const Intersection& vis_intersection, const T& vis_obj, Vector& result) {
+// A ray on the path stack of TracePath.
+struct PathFrame {
+    PathFrame(const Ray& ray, int depth, double weight, int parent, int slot, double scale,
+              Bounce bounce)
+        : ray(ray),
+          depth(depth),
+          weight(weight),
+          parent(parent),
+          slot(slot),
+          scale(scale),
+          bounce(std::move(bounce)) {
+    }
+
+    Ray ray;
+    int depth;
+    double weight;
+    // The color of the frame goes to secondary[slot] of the parent frame, times scale.
+    int parent;
+    int slot;
+    double scale;
+    Bounce bounce;
+    bool expanded = false;
+    // Colors seen along bounce.reflected and bounce.refracted.
+    Vector secondary[2];
+};
+
+// Whether a secondary ray of the given weight is traced under context.path. Updates weight and
+// sets the factor its color is scaled by.
+inline bool KeepSecondary(const TraceContext& context, const Ray& ray, double* weight,
+                          double* scale) {
+    *scale = 1;
+    if (*weight >= context.path.min_weight) {
+        return true;
+    }
+    double probability = *weight / context.path.min_weight;
+    if (!context.path.russian_roulette || HashRay(ray) >= probability) {
+        return false;
+    }
+    *scale = 1 / probability;
+    *weight = context.path.min_weight;
+    return true;
+}
+
+// Pushes the frame of a secondary ray of stack[index] unless it is not worth tracing.
+inline void PushSecondary(const TraceContext& context, std::vector<PathFrame>& stack, int index,
+                          const std::optional<Ray>& ray, int slot, double factor) {
+    int depth = stack[index].depth - 1;
+    if (!ray || depth == 0) {
+        return;
+    }
+    double weight = stack[index].weight * factor;
+    double scale;
+    if (!KeepSecondary(context, *ray, &weight, &scale)) {
+        return;
+    }
+    Count(slot == 0 ? &RenderStats::reflected_rays : &RenderStats::refracted_rays);
+    Hit hit = context.bvh.FindNearestIntersection(*ray);
+    if (!hit) {
+        // Nothing => backgroud is visible
+        return;
+    }
+    if (hit.triangle != nullptr) {
+        DefineNormal(*hit.triangle, hit.intersection);
+    }
+    Bounce bounce = GetBounce(context, *ray, hit);
+    stack.emplace_back(*ray, depth, weight, index, slot, scale, std::move(bounce));
+}
+
+// Color of a kFull mode hit with all its reflections and refractions up to depth. Secondary rays
+// live on an explicit stack rather than the call stack; a frame is combined once both of its
+// secondary rays are done, in the same order of operations as a recursive evaluation.
+inline void TracePath(const TraceContext& context, const Ray& view_ray, int depth, Hit& hit,
+                      Vector& result) {
+    thread_local std::vector<PathFrame> stack;
+    stack.clear();
+    stack.emplace_back(view_ray, depth, 1.0, -1, 0, 1.0, GetBounce(context, view_ray, hit));
+    while (!stack.empty()) {
+        int index = stack.size() - 1;
+        if (!stack[index].expanded) {
+            stack[index].expanded = true;
+            Count(&RenderStats::shaded_hits);
+            Count(&RenderStats::depth_sum, depth - stack[index].depth + 1);
+            PushSecondary(context, stack, index, stack[index].bounce.refracted, 1,
+                          stack[index].bounce.refraction);
+            PushSecondary(context, stack, index, stack[index].bounce.reflected, 0,
+                          stack[index].bounce.reflection);
+            continue;
+        }
+        const PathFrame& frame = stack[index];
+        Vector color = frame.bounce.local + frame.bounce.reflection * frame.secondary[0] +
+                       frame.secondary[1] * frame.bounce.refraction;
+        if (frame.parent < 0) {
+            result = color;
+        } else {
+            stack[frame.parent].secondary[frame.slot] =
+                frame.scale == 1 ? color : color * frame.scale;
+        }
+        stack.pop_back();
+    }
+}
+
+// Color seen along view_ray given what it hits.
+inline void Shade(const TraceContext& context, const Ray& view_ray, RenderOptions opt, Hit& hit,
+                  Vector& result) {
+    if (!hit) {
+        // Nothing => backgroud is visible
+        result = Vector();
+        return;
+    }
+    if (hit.triangle != nullptr) {
+        DefineNormal(*hit.triangle, hit.intersection);
+    }
     if (opt.mode == RenderMode::kDepth) {
-        auto d = vis_intersection.GetDistance();
+        auto d = hit.intersection.GetDistance();
         result = {d, d, d};
     } else if (opt.mode == RenderMode::kNormal) {
-        auto& norm = vis_intersection.GetNormal();
+        auto& norm = hit.intersection.GetNormal();
         result = {norm[0], norm[1], norm[2]};
     } else {
-        Vector general, diffusion, specular, reflected, refracted;
-        general = vis_obj.material->intensity + vis_obj.material->ambient_color;
-        // Specular and diffusion
-        for (const auto& light : scene.GetLights()) {
-            auto light_vector = vis_intersection.GetPosition() - light.position;
-            light_vector.Normalize();
-            Ray light_ray(light.position, light_vector);
-            // check is vis_obj in shadow
-            if (IsInShadow(scene, light, vis_intersection.GetPosition())) {
-                continue;
-            }
-            double l_d =
-                std::max(0.0, DotProduct(-light_ray.GetDirection(), vis_intersection.GetNormal()));
-            double l_s = std::pow(std::max(0.0, DotProduct(-view_ray.GetDirection(),
-                                                           Reflect(light_ray.GetDirection(),
-                                                                   vis_intersection.GetNormal()))),
-                                  vis_obj.material->specular_exponent);
-            diffusion = diffusion + l_d * light.intensity * vis_obj.material->diffuse_color;
-            specular = specular + l_s * light.intensity * vis_obj.material->specular_color;
-        }
-        // Refraction
-        opt.depth -= 1;
-        bool inside = vis_obj.IsInside(view_ray.GetDirection(), vis_intersection.GetNormal());
-        if (vis_obj.material->albedo[2] > 0) {
-            double eta = 1.0 / vis_obj.material->refraction_index;
-            auto refracted_ray =
-                Refract(view_ray.GetDirection(), vis_intersection.GetNormal(), eta);
-            refracted_ray->Normalize();
-            if (refracted_ray) {
-                Vector origin = vis_intersection.GetPosition() + 1e-5 * refracted_ray.value();
-                RayCast(scene, Ray(origin, refracted_ray.value()), opt, refracted);
-                if (!inside) {
-                    refracted = refracted * vis_obj.material->albedo[2];
-                }
-            }
-        }
-        // Reflection
-        if (vis_obj.material->albedo[1] > 0 && !inside) {
-            Vector origin = vis_intersection.GetPosition() + 1e-5 * vis_intersection.GetNormal();
-            Vector reflected_ray = Reflect(view_ray.GetDirection(), vis_intersection.GetNormal());
-            reflected_ray.Normalize();
-            RayCast(scene, Ray(origin, reflected_ray), opt, reflected);
-        }
-        result = general + vis_obj.material->albedo[0] * (diffusion + specular) +
-                 vis_obj.material->albedo[1] * reflected + refracted;
+        TracePath(context, view_ray, opt.depth, hit, result);
     }
 }
 
-void RayCast(const Scene& scene, const Ray& view_ray, RenderOptions opt, Vector& result) {
+void RayCast(const TraceContext& context, const Ray& view_ray, RenderOptions opt, Vector& result) {
     if (opt.depth == 0) {
         result = Vector();
     } else {
         // Find visible object
-        Intersection best_intersection;
-        // flag is true if triangle was found
-        bool triangle_f = false;
-        auto triangle =
-            FindNearestIntersection(scene.GetObjects(), view_ray, best_intersection, triangle_f);
-        triangle_f = triangle != nullptr;
-        auto sphere = FindNearestIntersection(scene.GetSphereObjects(), view_ray, best_intersection,
-                                              triangle_f);
-        if (sphere != nullptr) {
-            // Sphere is visible!
-            GetColor(scene, view_ray, opt, best_intersection, *sphere, result);
-        } else if (triangle != nullptr) {
-            // Triangle is visible
-            DefineNormal(*triangle, best_intersection);
-            GetColor(scene, view_ray, opt, best_intersection, *triangle, result);
-        } else {
-            // Nothing => backgroud is visible
-            result = Vector();
+        Count(&RenderStats::primary_rays);
+        Hit hit = context.bvh.FindNearestIntersection(view_ray);
+        Shade(context, view_ray, opt, hit, result);
+    }
+}
+
+// Allocator for cache line aligned storage.
+template <class T>
+struct CacheAlignedAllocator {
+    using value_type = T;
+    static constexpr std::align_val_t kAlignment{64};
+
+    CacheAlignedAllocator() = default;
+
+    template <class U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {
+    }
+
+    T* allocate(size_t size) {
+        return static_cast<T*>(::operator new(size * sizeof(T), kAlignment));
+    }
+
+    void deallocate(T* ptr, size_t) {
+        ::operator delete(ptr, kAlignment);
+    }
+
+    template <class U>
+    bool operator==(const CacheAlignedAllocator<U>&) const {
+        return true;
+    }
+};
+
+// Traced colors of a frame in one contiguous, cache line aligned block, row by row with three
+// channels per pixel. T is double, or float to halve the memory of large frames. Resizing never
+// gives memory back, so one buffer can be reused for every frame.
+template <class T>
+class BasicFramebuffer {
+public:
+    BasicFramebuffer() = default;
+
+    BasicFramebuffer(int width, int height) {
+        Resize(width, height);
+    }
+
+    void Resize(int width, int height) {
+        width_ = width;
+        height_ = height;
+        data_.resize(3 * static_cast<size_t>(width) * height);
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    Vector Get(int i, int j) const {
+        const T* pixel = &data_[3 * (static_cast<size_t>(i) * width_ + j)];
+        return {pixel[0], pixel[1], pixel[2]};
+    }
+
+    void Set(int i, int j, const Vector& color) {
+        T* pixel = &data_[3 * (static_cast<size_t>(i) * width_ + j)];
+        for (int k = 0; k < 3; ++k) {
+            pixel[k] = color[k];
+        }
+    }
+
+    const T* Data() const {
+        return data_.data();
+    }
+
+    // The 3 * Width() channels of row i.
+    const T* Row(int i) const {
+        return &data_[3 * static_cast<size_t>(i) * width_];
+    }
+
+    // PostProc takes the colors as rows of Vector.
+    std::vector<std::vector<Vector>> ToColorMap() const {
+        std::vector<std::vector<Vector>> color_map(height_, std::vector<Vector>(width_));
+        for (int i = 0; i < height_; ++i) {
+            for (int j = 0; j < width_; ++j) {
+                color_map[i][j] = Get(i, j);
+            }
+        }
+        return color_map;
+    }
+
+private:
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<T, CacheAlignedAllocator<T>> data_;
+};
+
+using Framebuffer = BasicFramebuffer<double>;
+using FloatFramebuffer = BasicFramebuffer<float>;
+
+struct Tile {
+    int row_begin;
+    int row_end;
+    int col_begin;
+    int col_end;
+};
+
+inline std::vector<Tile> SplitIntoTiles(int height, int width, int tile_size) {
+    std::vector<Tile> tiles;
+    for (int i = 0; i < height; i += tile_size) {
+        for (int j = 0; j < width; j += tile_size) {
+            tiles.push_back(
+                {i, std::min(height, i + tile_size), j, std::min(width, j + tile_size)});
+        }
+    }
+    return tiles;
+}
+
+template <class T>
+void RenderTile(const TraceContext& context, const Transformer& transformer,
+                const RenderOptions& render_options, const Tile& tile,
+                BasicFramebuffer<T>* framebuffer) {
+    for (int i = tile.row_begin; i < tile.row_end; ++i) {
+        for (int j = tile.col_begin; j < tile.col_end; ++j) {
+            Ray view_ray = transformer.MakeRay(i, j);
+            Vector color;
+            RayCast(context, view_ray, render_options, color);
+            framebuffer->Set(i, j, color);
+        }
+    }
+}
+
+// RenderTile that traces primary rays in packets of neighbouring pixels of a row. Secondary and
+// shadow rays diverge after the first bounce, so shading continues with single rays.
+template <class T>
+void RenderTilePackets(const TraceContext& context, const Transformer& transformer,
+                       const RenderOptions& render_options, const Tile& tile,
+                       BasicFramebuffer<T>* framebuffer) {
+    if (render_options.depth == 0) {
+        RenderTile(context, transformer, render_options, tile, framebuffer);
+        return;
+    }
+    constexpr int kPacketSize = Bvh::kPacketSize;
+    std::vector<Ray> rays;
+    Hit hits[kPacketSize];
+    for (int i = tile.row_begin; i < tile.row_end; ++i) {
+        for (int j = tile.col_begin; j < tile.col_end; j += kPacketSize) {
+            int count = std::min(kPacketSize, tile.col_end - j);
+            rays.clear();
+            for (int lane = 0; lane < count; ++lane) {
+                rays.push_back(transformer.MakeRay(i, j + lane));
+            }
+            Count(&RenderStats::primary_rays, count);
+            context.bvh.FindNearestIntersections(rays.data(), count, hits);
+            for (int lane = 0; lane < count; ++lane) {
+                Vector color;
+                Shade(context, rays[lane], render_options, hits[lane], color);
+                framebuffer->Set(i, j + lane, color);
+            }
+        }
+    }
+}
+
+// Work-stealing tile queue. Every worker starts with a contiguous run of tiles, takes them from
+// the back of its own deque and, once that is empty, steals from the front of the others, so
+// tiles that are expensive (deep reflections, glass) do not leave the other cores idle.
+class TileScheduler {
+public:
+    TileScheduler(const std::vector<Tile>& tiles, int num_workers) : queues_(num_workers) {
+        size_t per_worker = (tiles.size() + num_workers - 1) / num_workers;
+        for (size_t k = 0; k < tiles.size(); ++k) {
+            queues_[k / per_worker].tiles.push_back(tiles[k]);
+        }
+    }
+
+    std::optional<Tile> Next(int worker) {
+        {
+            Queue& own = queues_[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.tiles.empty()) {
+                Tile tile = own.tiles.back();
+                own.tiles.pop_back();
+                return tile;
+            }
+        }
+        for (size_t k = 1; k < queues_.size(); ++k) {
+            Queue& victim = queues_[(worker + k) % queues_.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tiles.empty()) {
+                Tile tile = victim.tiles.front();
+                victim.tiles.pop_front();
+                return tile;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    std::vector<Queue> queues_;
+};
+
+// Wall time spent on every tile of a frame, row-major over the tile grid.
+struct TileTimes {
+    int tile_size = 0;
+    int rows = 0;
+    int cols = 0;
+    std::vector<double> seconds;
+
+    // Each tile filled with its time on a black-red-yellow-white ramp, scaled to the slowest.
+    // std::nullopt if the times were recorded for another image size or tile size.
+    std::optional<Image> ToHeatmap(int width, int height) const {
+        if (tile_size <= 0 || rows != (height + tile_size - 1) / tile_size ||
+            cols != (width + tile_size - 1) / tile_size ||
+            seconds.size() != static_cast<size_t>(rows) * cols) {
+            return std::nullopt;
+        }
+        Image img(width, height);
+        double max_seconds = 0;
+        for (double time : seconds) {
+            max_seconds = std::max(max_seconds, time);
+        }
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                double time = seconds[(y / tile_size) * cols + x / tile_size];
+                double heat = max_seconds > 0 ? 3 * time / max_seconds : 0;
+                auto channel = [heat](int k) {
+                    return static_cast<int>(255 * std::clamp(heat - k, 0.0, 1.0));
+                };
+                img.SetPixel({channel(0), channel(1), channel(2)}, y, x);
+            }
+        }
+        return img;
+    }
+};
+
+struct ParallelOptions {
+    // 0 means one thread per hardware thread.
+    int num_threads = 0;
+    int tile_size = 16;
+    // Trace primary rays in packets of Bvh::kPacketSize. RenderOptions is shared with the rest
+    // of the raytracer, so the switch lives here with the other execution settings.
+    bool packet_tracing = false;
+    // Render with RenderWavefront instead of tiles.
+    bool wavefront = false;
+    PathOptions path;
+    LightOptions light;
+    // Keep the BVH of a scene file in a binary cache next to it, see Bvh::Save. This only skips
+    // the SAH build: the scene itself is still parsed by ReadScene on every render.
+    bool cache_bvh = false;
+    // Post-process tiles on the worker threads with ToneMapper instead of calling PostProc on
+    // the finished frame. kNormal tiles are written to the image as soon as they are traced.
+    bool tile_postprocess = false;
+    // Filled with the time of every tile. Not used by the wavefront renderer.
+    TileTimes* tile_times = nullptr;
+};
+
+inline Bvh MakeBvh(const Scene& scene, const std::string& filename,
+                   const ParallelOptions& parallel_options) {
+    if (parallel_options.cache_bvh) {
+        return Bvh::LoadOrBuild(scene, filename + ".bvh");
+    }
+    return Bvh(scene);
+}
+
+// The transfer of PostProc from traced colors to pixels, split up so that it runs per tile:
+// kDepth divides by the largest channel value of the frame, kNormal maps [-1, 1] to [0, 1] and
+// kFull applies Reinhard tone mapping with the largest value as white point followed by gamma
+// 1 / 2.2. Only the largest value couples the tiles, so it is reduced per tile first.
+class ToneMapper {
+public:
+    ToneMapper(RenderMode mode, double max_value) : mode_(mode), max_value_(max_value) {
+    }
+
+    static bool NeedsMaxValue(RenderMode mode) {
+        return mode != RenderMode::kNormal;
+    }
+
+    template <class T>
+    static double GetMaxValue(const BasicFramebuffer<T>& framebuffer, const Tile& tile) {
+        double max_value = 0;
+        for (int i = tile.row_begin; i < tile.row_end; ++i) {
+            const T* row = framebuffer.Row(i);
+            for (int k = 3 * tile.col_begin; k < 3 * tile.col_end; ++k) {
+                max_value = std::max<double>(max_value, row[k]);
+            }
+        }
+        return max_value;
+    }
+
+    // Writes the pixels of tile into img. The loops over the channels of a row only depend on
+    // the mode, so the compiler vectorizes them.
+    template <class T>
+    void Apply(const BasicFramebuffer<T>& framebuffer, const Tile& tile, Image* img) const {
+        int size = 3 * (tile.col_end - tile.col_begin);
+        std::vector<double> values(size);
+        double scale = max_value_ > 0 ? 1 / max_value_ : 0;
+        double white2 = max_value_ * max_value_;
+        for (int i = tile.row_begin; i < tile.row_end; ++i) {
+            const T* row = framebuffer.Row(i) + 3 * tile.col_begin;
+            if (mode_ == RenderMode::kDepth) {
+                for (int k = 0; k < size; ++k) {
+                    values[k] = row[k] * scale;
+                }
+            } else if (mode_ == RenderMode::kNormal) {
+                for (int k = 0; k < size; ++k) {
+                    values[k] = 0.5 * row[k] + 0.5;
+                }
+            } else if (max_value_ > 0) {
+                for (int k = 0; k < size; ++k) {
+                    double x = row[k];
+                    values[k] = x * (1 + x / white2) / (1 + x);
+                }
+                for (int k = 0; k < size; ++k) {
+                    values[k] = std::pow(values[k], 1 / 2.2);
+                }
+            } else {
+                std::fill(values.begin(), values.end(), 0.0);
+            }
+            for (int j = tile.col_begin; j < tile.col_end; ++j) {
+                const double* pixel = &values[3 * (j - tile.col_begin)];
+                img->SetPixel({static_cast<int>(std::round(pixel[0] * 255)),
+                               static_cast<int>(std::round(pixel[1] * 255)),
+                               static_cast<int>(std::round(pixel[2] * 255))},
+                              i, j);
+            }
+        }
+    }
+
+private:
+    RenderMode mode_;
+    double max_value_;
+};
+
+inline int GetNumThreads(const ParallelOptions& parallel_options) {
+    if (parallel_options.num_threads > 0) {
+        return parallel_options.num_threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls body(k) for every k in [0, count) on num_threads threads, handing out chunks of
+// consecutive indices.
+template <class F>
+void ParallelFor(size_t count, int num_threads, F&& body) {
+    constexpr size_t kChunk = 64;
+    num_threads = std::max<int>(1, std::min<size_t>(num_threads, (count + kChunk - 1) / kChunk));
+    std::atomic<size_t> next = 0;
+    auto worker = [&] {
+        for (size_t begin; (begin = next.fetch_add(kChunk)) < count;) {
+            for (size_t k = begin; k < std::min(count, begin + kChunk); ++k) {
+                body(k);
+            }
+        }
+    };
+    RunWorkers(num_threads, [&worker](int) { worker(); });
+}
+
+// Wavefront rendering: rays are traced one generation at a time over the whole frame instead of
+// pixel by pixel. Every wave goes through the same stages:
+//   1. nearest hits of all rays of the wave, in packets;
+//   2. hits sorted by object type and material, so that shading runs the same code on the same
+//      data for long stretches;
+//   3. shadow rays of all hits, grouped by light, so that consecutive rays share their origin;
+//   4. shading, which also emits the reflected and refracted rays of the next wave.
+// Once the last wave is done the colors are combined from the deepest wave up, in the same order
+// of operations as TracePath, so the image is identical to the other modes.
+template <class T>
+void RenderWavefront(const TraceContext& context, const Transformer& transformer,
+                     const RenderOptions& render_options, const ParallelOptions& parallel_options,
+                     BasicFramebuffer<T>* framebuffer) {
+    int num_threads = GetNumThreads(parallel_options);
+    int width = framebuffer->Width();
+    size_t num_pixels = static_cast<size_t>(width) * framebuffer->Height();
+    if (render_options.depth == 0) {
+        for (size_t pixel = 0; pixel < num_pixels; ++pixel) {
+            framebuffer->Set(pixel / width, pixel % width, Vector());
+        }
+        return;
+    }
+
+    // Where the color of a ray goes: secondary[slot] of node parent of the previous wave, or
+    // pixel parent for the first wave.
+    struct RayTarget {
+        int depth;
+        double weight;
+        size_t parent;
+        int slot;
+        double scale;
+    };
+    struct WaveNode {
+        size_t parent;
+        int slot;
+        double scale;
+        Bounce bounce;
+        Vector secondary[2];
+    };
+
+    std::vector<Ray> rays;
+    std::vector<RayTarget> targets;
+    rays.reserve(num_pixels);
+    for (size_t pixel = 0; pixel < num_pixels; ++pixel) {
+        rays.push_back(transformer.MakeRay(pixel / width, pixel % width));
+        targets.push_back({render_options.depth, 1.0, pixel, 0, 1.0});
+    }
+    std::vector<std::vector<WaveNode>> waves;
+    const auto& lights = context.GetLights();
+    std::vector<Hit> hits;
+    std::vector<uint8_t> shadowed;
+    while (!rays.empty()) {
+        // 1. Intersection
+        constexpr size_t kPacketSize = Bvh::kPacketSize;
+        if (waves.empty()) {
+            Count(&RenderStats::primary_rays, rays.size());
+        }
+        hits.resize(rays.size());
+        ParallelFor((rays.size() + kPacketSize - 1) / kPacketSize, num_threads, [&](size_t k) {
+            size_t begin = k * kPacketSize;
+            int count = std::min(kPacketSize, rays.size() - begin);
+            context.bvh.FindNearestIntersections(&rays[begin], count, &hits[begin]);
+        });
+
+        // 2. Sorting. Misses see the background, which is zero.
+        std::vector<size_t> order;
+        for (size_t k = 0; k < hits.size(); ++k) {
+            if (hits[k]) {
+                order.push_back(k);
+            }
+        }
+        auto key = [&hits](size_t k) {
+            const Hit& hit = hits[k];
+            return hit.sphere ? std::pair(1, hit.sphere->material)
+                              : std::pair(0, hit.triangle->material);
+        };
+        std::stable_sort(order.begin(), order.end(),
+                         [&key](size_t lhs, size_t rhs) { return key(lhs) < key(rhs); });
+        if (render_options.mode != RenderMode::kFull) {
+            for (size_t k = 0; k < rays.size(); ++k) {
+                Vector color;
+                Shade(context, rays[k], render_options, hits[k], color);
+                size_t pixel = targets[k].parent;
+                framebuffer->Set(pixel / width, pixel % width, color);
+            }
+            return;
+        }
+        ParallelFor(order.size(), num_threads, [&](size_t m) {
+            Hit& hit = hits[order[m]];
+            if (hit.triangle != nullptr) {
+                DefineNormal(*hit.triangle, hit.intersection);
+            }
+        });
+
+        // 3. Shadow rays, light-major, except for the lights that shading skips. Sampled lights
+        // are only known while shading, which traces their shadow rays itself.
+        bool sampled = context.SamplesLights();
+        shadowed.assign(sampled ? 0 : lights.size() * order.size(), 0);
+        ParallelFor(shadowed.size(), num_threads, [&](size_t k) {
+            size_t light_index = k / order.size();
+            size_t ray_index = order[k % order.size()];
+            const Hit& hit = hits[ray_index];
+            const auto& light = lights[light_index];
+            double light_distance;
+            Ray light_ray = GetLightRay(light, hit.intersection.GetPosition(), &light_distance);
+            double weight = GetLightWeight(rays[ray_index], hit, light, light_ray);
+            if (!IsLightSkipped(context, weight)) {
+                shadowed[k] = IsInShadow(context, light_ray, light_distance);
+            }
+        });
+
+        // 4. Shading
+        auto& nodes = waves.emplace_back();
+        nodes.reserve(order.size());
+        for (size_t m = 0; m < order.size(); ++m) {
+            const RayTarget& target = targets[order[m]];
+            nodes.push_back({target.parent, target.slot, target.scale, {}, {}});
+        }
+        size_t level = waves.size();
+        ParallelFor(order.size(), num_threads, [&](size_t m) {
+            size_t k = order[m];
+            Count(&RenderStats::shaded_hits);
+            Count(&RenderStats::depth_sum, level);
+            nodes[m].bounce = GetBounce(context, rays[k], hits[k],
+                                        [&](size_t light_index, const Ray& light_ray,
+                                            double light_distance) -> bool {
+                                            if (sampled) {
+                                                return IsInShadow(context, light_ray,
+                                                                  light_distance);
+                                            }
+                                            return shadowed[light_index * order.size() + m];
+                                        });
+        });
+        std::vector<Ray> next_rays;
+        std::vector<RayTarget> next_targets;
+        for (size_t m = 0; m < order.size(); ++m) {
+            const RayTarget& target = targets[order[m]];
+            const Bounce& bounce = nodes[m].bounce;
+            int depth = target.depth - 1;
+            if (depth == 0) {
+                continue;
+            }
+            const std::optional<Ray>* secondary[2] = {&bounce.reflected, &bounce.refracted};
+            double factors[2] = {bounce.reflection, bounce.refraction};
+            for (int slot = 0; slot < 2; ++slot) {
+                if (!*secondary[slot]) {
+                    continue;
+                }
+                double weight = target.weight * factors[slot];
+                double scale;
+                if (KeepSecondary(context, **secondary[slot], &weight, &scale)) {
+                    Count(slot == 0 ? &RenderStats::reflected_rays
+                                    : &RenderStats::refracted_rays);
+                    next_rays.push_back(**secondary[slot]);
+                    next_targets.push_back({depth, weight, m, slot, scale});
+                }
+            }
+        }
+        rays = std::move(next_rays);
+        targets = std::move(next_targets);
+    }
+
+    for (size_t pixel = 0; pixel < num_pixels; ++pixel) {
+        framebuffer->Set(pixel / width, pixel % width, Vector());
+    }
+    for (size_t wave = waves.size(); wave-- > 0;) {
+        for (const auto& node : waves[wave]) {
+            Vector color = node.bounce.local + node.bounce.reflection * node.secondary[0] +
+                           node.secondary[1] * node.bounce.refraction;
+            if (node.scale != 1) {
+                color = color * node.scale;
+            }
+            if (wave == 0) {
+                framebuffer->Set(node.parent / width, node.parent % width, color);
+            } else {
+                waves[wave - 1][node.parent].secondary[node.slot] = color;
+            }
         }
     }
 }
 
+// Traces the tiles of a frame on parallel_options.num_threads threads. on_tile is called on the
+// worker thread right after a tile is traced.
+template <class T>
+void RenderTiles(const TraceContext& context, const Transformer& transformer,
+                 const RenderOptions& render_options, const ParallelOptions& parallel_options,
+                 BasicFramebuffer<T>* framebuffer,
+                 const std::function<void(const Tile&)>& on_tile = {}) {
+    auto tiles =
+        SplitIntoTiles(framebuffer->Height(), framebuffer->Width(), parallel_options.tile_size);
+    int num_threads = std::min<int>(GetNumThreads(parallel_options), tiles.size());
+    num_threads = std::max(1, num_threads);
+
+    TileTimes* times = parallel_options.tile_times;
+    int tile_size = parallel_options.tile_size;
+    if (times) {
+        times->tile_size = tile_size;
+        times->rows = (framebuffer->Height() + tile_size - 1) / tile_size;
+        times->cols = (framebuffer->Width() + tile_size - 1) / tile_size;
+        times->seconds.assign(times->rows * times->cols, 0);
+    }
+
+    TileScheduler scheduler(tiles, num_threads);
+    auto worker = [&](int index) {
+        while (auto tile = scheduler.Next(index)) {
+            auto start = std::chrono::steady_clock::now();
+            if (parallel_options.packet_tracing) {
+                RenderTilePackets(context, transformer, render_options, *tile, framebuffer);
+            } else {
+                RenderTile(context, transformer, render_options, *tile, framebuffer);
+            }
+            if (on_tile) {
+                on_tile(*tile);
+            }
+            if (times) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                int row = tile->row_begin / tile_size;
+                times->seconds[row * times->cols + tile->col_begin / tile_size] = elapsed.count();
+            }
+        }
+    };
+    RunWorkers(num_threads, worker);
+}
+
 Image Render(const std::string& filename, const CameraOptions& camera_options,
              const RenderOptions& render_options) {
     auto scene = ReadScene(filename);
+    Bvh bvh(scene);
+    TraceContext context{scene, bvh};
     Image img(camera_options.screen_width, camera_options.screen_height);
     Transformer transformer(camera_options);
 
-    std::vector<std::vector<Vector>> color_map(img.Height(), std::vector<Vector>(img.Width()));
-    for (int i = 0; i < img.Height(); ++i) {
-        for (int j = 0; j < img.Width(); ++j) {
-            Ray view_ray = transformer.MakeRay(i, j);
-            RayCast(scene, view_ray, render_options, color_map[i][j]);
-        }
+    Framebuffer framebuffer(img.Width(), img.Height());
+    RenderTile(context, transformer, render_options, {0, img.Height(), 0, img.Width()},
+               &framebuffer);
+
+    PostProc(img, framebuffer.ToColorMap(), render_options);
+    return img;
+}
+
+// Traces the frame without post-processing into a caller-provided framebuffer, which is resized
+// to the camera. Repeated renders into the same buffer do not allocate it again.
+template <class T>
+void Render(const std::string& filename, const CameraOptions& camera_options,
+            const RenderOptions& render_options, const ParallelOptions& parallel_options,
+            BasicFramebuffer<T>* framebuffer) {
+    auto scene = ReadScene(filename);
+    Bvh bvh = MakeBvh(scene, filename, parallel_options);
+    TraceContext context{scene, bvh, parallel_options.path, nullptr, parallel_options.light};
+    Transformer transformer(camera_options);
+    framebuffer->Resize(camera_options.screen_width, camera_options.screen_height);
+    if (parallel_options.wavefront) {
+        RenderWavefront(context, transformer, render_options, parallel_options, framebuffer);
+    } else {
+        RenderTiles(context, transformer, render_options, parallel_options, framebuffer);
+    }
+}
+
+// Renders tiles on several threads. Every pixel is traced exactly as in the serial Render, so
+// the image is identical regardless of the number of threads.
+Image Render(const std::string& filename, const CameraOptions& camera_options,
+             const RenderOptions& render_options, const ParallelOptions& parallel_options) {
+    Framebuffer framebuffer;
+    Image img(camera_options.screen_width, camera_options.screen_height);
+    if (!parallel_options.tile_postprocess || parallel_options.wavefront) {
+        Render(filename, camera_options, render_options, parallel_options, &framebuffer);
+        PostProc(img, framebuffer.ToColorMap(), render_options);
+        return img;
     }
 
-    PostProc(img, color_map, render_options);
+    auto scene = ReadScene(filename);
+    Bvh bvh = MakeBvh(scene, filename, parallel_options);
+    TraceContext context{scene, bvh, parallel_options.path, nullptr, parallel_options.light};
+    Transformer transformer(camera_options);
+    framebuffer.Resize(camera_options.screen_width, camera_options.screen_height);
+    if (!ToneMapper::NeedsMaxValue(render_options.mode)) {
+        ToneMapper tone_mapper(render_options.mode, 0);
+        RenderTiles(context, transformer, render_options, parallel_options, &framebuffer,
+                    [&](const Tile& tile) { tone_mapper.Apply(framebuffer, tile, &img); });
+        return img;
+    }
+    // Two-phase reduction: every tile takes its maximum right after it is traced, the frame
+    // maximum is known after the last one.
+    std::atomic<double> max_value = 0;
+    RenderTiles(context, transformer, render_options, parallel_options, &framebuffer,
+                [&](const Tile& tile) {
+                    double tile_max = ToneMapper::GetMaxValue(framebuffer, tile);
+                    double current = max_value.load();
+                    while (tile_max > current &&
+                           !max_value.compare_exchange_weak(current, tile_max)) {
+                    }
+                });
+    ToneMapper tone_mapper(render_options.mode, max_value.load());
+    auto tiles = SplitIntoTiles(img.Height(), img.Width(), parallel_options.tile_size);
+    ParallelFor(tiles.size(), GetNumThreads(parallel_options),
+                [&](size_t k) { tone_mapper.Apply(framebuffer, tiles[k], &img); });
     return img;
 }
+
+// Supersampling of ProgressiveRenderer.
+struct AdaptiveOptions {
+    // Pixels are supersampled while their tone mapped color c / (1 + c) differs from one of their
+    // neighbours by more than this in some channel.
+    double threshold = 0.05;
+    int samples_per_pass = 4;
+    // Including the sample at the pixel center.
+    int max_samples = 16;
+};
+
+// Renders a frame in passes for interactive previews. The first pass traces every 8th pixel in
+// both directions and each following pass halves the spacing, so a coarse image is there after
+// a fraction of the rays; pixels not traced yet repeat the nearest traced one above and to the
+// left. Once every pixel has its center sample, which is the image Render produces, the passes
+// supersample the pixels that differ from their neighbours (edges, refractive boundaries) until
+// none is left or they reach AdaptiveOptions::max_samples.
+class ProgressiveRenderer {
+public:
+    ProgressiveRenderer(const std::string& filename, const CameraOptions& camera_options,
+                        const RenderOptions& render_options,
+                        const ParallelOptions& parallel_options = {},
+                        const AdaptiveOptions& adaptive_options = {})
+        : scene_(ReadScene(filename)),
+          bvh_(MakeBvh(scene_, filename, parallel_options)),
+          context_{scene_, bvh_, parallel_options.path, nullptr, parallel_options.light},
+          transformer_(camera_options),
+          render_options_(render_options),
+          num_threads_(GetNumThreads(parallel_options)),
+          adaptive_options_(adaptive_options),
+          sums_(camera_options.screen_width, camera_options.screen_height),
+          preview_(camera_options.screen_width, camera_options.screen_height),
+          counts_(static_cast<size_t>(camera_options.screen_width) * camera_options.screen_height) {
+    }
+
+    ProgressiveRenderer(const ProgressiveRenderer&) = delete;
+    ProgressiveRenderer& operator=(const ProgressiveRenderer&) = delete;
+
+    // Runs one pass. Returns false, without doing anything, once no pixel needs more samples.
+    bool Refine() {
+        if (stride_ > 0) {
+            TraceGrid();
+            stride_ /= 2;
+            return true;
+        }
+        return Supersample();
+    }
+
+    // Mean color of the samples of every pixel.
+    const Framebuffer& GetFramebuffer() const {
+        return preview_;
+    }
+
+    Image GetImage() const {
+        Image img(preview_.Width(), preview_.Height());
+        PostProc(img, preview_.ToColorMap(), render_options_);
+        return img;
+    }
+
+private:
+    static constexpr int kInitialStride = 8;
+
+    void TraceGrid() {
+        int width = sums_.Width();
+        int height = sums_.Height();
+        std::vector<std::pair<int, int>> pixels;
+        for (int i = 0; i < height; i += stride_) {
+            for (int j = 0; j < width; j += stride_) {
+                if (counts_[static_cast<size_t>(i) * width + j] == 0) {
+                    pixels.emplace_back(i, j);
+                }
+            }
+        }
+        ParallelFor(pixels.size(), num_threads_, [&](size_t k) {
+            auto [i, j] = pixels[k];
+            Vector color;
+            RayCast(context_, transformer_.MakeRay(i, j), render_options_, color);
+            sums_.Set(i, j, color);
+            counts_[static_cast<size_t>(i) * width + j] = 1;
+        });
+        for (int i = 0; i < height; ++i) {
+            for (int j = 0; j < width; ++j) {
+                if (counts_[static_cast<size_t>(i) * width + j] > 0) {
+                    preview_.Set(i, j, sums_.Get(i, j));
+                } else {
+                    preview_.Set(i, j, sums_.Get(i - i % stride_, j - j % stride_));
+                }
+            }
+        }
+    }
+
+    bool Supersample() {
+        int width = sums_.Width();
+        int height = sums_.Height();
+        std::vector<std::pair<int, int>> pixels;
+        for (int i = 0; i < height; ++i) {
+            for (int j = 0; j < width; ++j) {
+                if (counts_[static_cast<size_t>(i) * width + j] < adaptive_options_.max_samples &&
+                    IsEdge(i, j)) {
+                    pixels.emplace_back(i, j);
+                }
+            }
+        }
+        if (pixels.empty()) {
+            return false;
+        }
+        ParallelFor(pixels.size(), num_threads_, [&](size_t k) {
+            auto [i, j] = pixels[k];
+            int& count = counts_[static_cast<size_t>(i) * width + j];
+            Vector sum = sums_.Get(i, j);
+            int samples = std::min(adaptive_options_.samples_per_pass,
+                                   adaptive_options_.max_samples - count);
+            for (int n = 0; n < samples; ++n, ++count) {
+                // R2 low discrepancy sequence over the pixel; sample 0 is the center.
+                double dx = std::fmod(0.5 + count * 0.7548776662466927, 1.0) - 0.5;
+                double dy = std::fmod(0.5 + count * 0.5698402909980532, 1.0) - 0.5;
+                Vector color;
+                RayCast(context_, MakeSubpixelRay(i, j, dy, dx), render_options_, color);
+                sum = sum + color;
+            }
+            sums_.Set(i, j, sum);
+        });
+        for (auto [i, j] : pixels) {
+            int count = counts_[static_cast<size_t>(i) * width + j];
+            preview_.Set(i, j, sums_.Get(i, j) * (1.0 / count));
+        }
+        return true;
+    }
+
+    bool IsEdge(int i, int j) const {
+        Vector color = preview_.Get(i, j);
+        const int di[] = {-1, 1, 0, 0};
+        const int dj[] = {0, 0, -1, 1};
+        for (int k = 0; k < 4; ++k) {
+            int y = i + di[k];
+            int x = j + dj[k];
+            if (y < 0 || y >= preview_.Height() || x < 0 || x >= preview_.Width()) {
+                continue;
+            }
+            Vector other = preview_.Get(y, x);
+            for (int c = 0; c < 3; ++c) {
+                if (std::abs(color[c] / (1 + std::abs(color[c])) -
+                             other[c] / (1 + std::abs(other[c]))) > adaptive_options_.threshold) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Transformer only makes rays through pixel centers. A ray through (i + dy, j + dx) is
+    // interpolated from the directions towards the neighbouring centers, which is exact up to
+    // the normalization for a pinhole camera.
+    Ray MakeSubpixelRay(int i, int j, double dy, double dx) const {
+        Ray center = transformer_.MakeRay(i, j);
+        Vector direction = center.GetDirection();
+        auto step = [&](int y, int x, double t) {
+            if (y < 0 || y >= preview_.Height() || x < 0 || x >= preview_.Width()) {
+                // Towards the other neighbour, backwards.
+                Ray other = transformer_.MakeRay(2 * i - y, 2 * j - x);
+                return -t * (other.GetDirection() - center.GetDirection());
+            }
+            Ray other = transformer_.MakeRay(y, x);
+            return t * (other.GetDirection() - center.GetDirection());
+        };
+        if (preview_.Width() > 1) {
+            direction = direction + step(i, j + (dx < 0 ? -1 : 1), std::abs(dx));
+        }
+        if (preview_.Height() > 1) {
+            direction = direction + step(i + (dy < 0 ? -1 : 1), j, std::abs(dy));
+        }
+        direction.Normalize();
+        return Ray(center.GetOrigin(), direction);
+    }
+
+    Scene scene_;
+    Bvh bvh_;
+    TraceContext context_;
+    Transformer transformer_;
+    RenderOptions render_options_;
+    int num_threads_;
+    AdaptiveOptions adaptive_options_;
+    // Sum and number of the samples of every pixel.
+    Framebuffer sums_;
+    Framebuffer preview_;
+    std::vector<int> counts_;
+    int stride_ = kInitialStride;
+};
+
+// Renders frames of one scene, which is read and indexed only once. Only the lights can
+// change between frames; the camera and the render options are per frame. The primary hit of
+// every pixel is cached together with its ray, so a frame where only the lights moved reshades
+// the cached hits without tracing primary rays, and an unchanged frame is not traced at all.
+// After a camera move every pixel whose ray changed is traced again.
+class Renderer {
+public:
+    explicit Renderer(const std::string& filename, const ParallelOptions& parallel_options = {})
+        : scene_(ReadScene(filename)),
+          bvh_(MakeBvh(scene_, filename, parallel_options)),
+          lights_(scene_.GetLights()),
+          parallel_options_(parallel_options) {
+    }
+
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    const std::vector<Light>& GetLights() const {
+        return lights_;
+    }
+
+    void SetLights(std::vector<Light> lights) {
+        lights_ = std::move(lights);
+        shaded_ = false;
+    }
+
+    // Traces the frame without post-processing into framebuffer, see Render above.
+    template <class T>
+    void Render(const CameraOptions& camera_options, const RenderOptions& render_options,
+                BasicFramebuffer<T>* framebuffer) {
+        int width = camera_options.screen_width;
+        int height = camera_options.screen_height;
+        size_t num_pixels = static_cast<size_t>(width) * height;
+        if (width != colors_.Width() || height != colors_.Height()) {
+            colors_.Resize(width, height);
+            pixels_.assign(num_pixels, {});
+            shaded_ = false;
+        }
+        if (!render_options_ || render_options.depth != render_options_->depth ||
+            render_options.mode != render_options_->mode) {
+            render_options_ = render_options;
+            shaded_ = false;
+        }
+
+        TraceContext context{scene_, bvh_, parallel_options_.path, &lights_,
+                             parallel_options_.light};
+        Transformer transformer(camera_options);
+        bool shaded = shaded_;
+        ParallelFor(num_pixels, GetNumThreads(parallel_options_), [&](size_t k) {
+            CachedPixel& pixel = pixels_[k];
+            Ray ray = transformer.MakeRay(k / width, k % width);
+            bool same_ray = pixel.traced && Equal(ray.GetOrigin(), pixel.origin) &&
+                            Equal(ray.GetDirection(), pixel.direction);
+            if (!same_ray) {
+                pixel.origin = ray.GetOrigin();
+                pixel.direction = ray.GetDirection();
+                Count(&RenderStats::primary_rays);
+                pixel.hit = bvh_.FindNearestIntersection(ray);
+                pixel.traced = true;
+            }
+            if (same_ray && shaded) {
+                return;
+            }
+            Vector color;
+            if (render_options.depth > 0) {
+                // Shading completes the hit with DefineNormal, the cache keeps it as found.
+                Hit hit = pixel.hit;
+                Shade(context, ray, render_options, hit, color);
+            }
+            colors_.Set(k / width, k % width, color);
+        });
+        shaded_ = true;
+
+        framebuffer->Resize(width, height);
+        for (int i = 0; i < height; ++i) {
+            for (int j = 0; j < width; ++j) {
+                framebuffer->Set(i, j, colors_.Get(i, j));
+            }
+        }
+    }
+
+    Image Render(const CameraOptions& camera_options, const RenderOptions& render_options) {
+        Render(camera_options, render_options, &framebuffer_);
+        Image img(camera_options.screen_width, camera_options.screen_height);
+        PostProc(img, framebuffer_.ToColorMap(), render_options);
+        return img;
+    }
+
+private:
+    static bool Equal(const Vector& lhs, const Vector& rhs) {
+        return lhs[0] == rhs[0] && lhs[1] == rhs[1] && lhs[2] == rhs[2];
+    }
+
+    struct CachedPixel {
+        Vector origin;
+        Vector direction;
+        Hit hit;
+        bool traced = false;
+    };
+
+    Scene scene_;
+    Bvh bvh_;
+    std::vector<Light> lights_;
+    ParallelOptions parallel_options_;
+    std::optional<RenderOptions> render_options_;
+    std::vector<CachedPixel> pixels_;
+    // Colors of the last frame; valid where the ray did not change if shaded_ is set.
+    Framebuffer colors_;
+    bool shaded_ = false;
+    Framebuffer framebuffer_;
+};